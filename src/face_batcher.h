@@ -0,0 +1,209 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-10
+// License: AGPL-3.0
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "face_metrics.h"
+#include "network_model.h"
+
+using namespace dlib;
+using namespace std;
+
+/*
+跨请求批量特征提取
+--------------------
+各请求提交对齐后的人脸图像块, 调度线程在等待窗口内凑批
+(达到 max_batch 个图像块或最早的请求等待满 max_wait_ms)
+后执行一次批量前向计算, 再把 128 维特征分发回各请求
+单个请求的图像块不会被拆到不同批次
+*/
+class FaceBatcher
+{
+public:
+    struct Stats
+    {
+        // 排队中的请求数与图像块数
+        size_t queue_requests;
+        size_t queue_chips;
+        uint64_t requests;
+        uint64_t batches;
+        uint64_t chips;
+        size_t max_batch;
+        // 批大小分布: 上界(含) -> 批次数
+        std::vector<std::pair<size_t, uint64_t>> histogram;
+    };
+
+    FaceBatcher(const anet_type &recognition, size_t max_batch, size_t max_wait_ms, size_t runners)
+        : max_batch(std::max<size_t>(1, max_batch)), max_wait(std::chrono::milliseconds(max_wait_ms))
+    {
+        for (size_t bound = 1; bound < this->max_batch; bound *= 2)
+        {
+            histogram.push_back(std::make_pair(bound, 0));
+        }
+        histogram.push_back(std::make_pair(this->max_batch, 0));
+        runners = std::max<size_t>(1, runners);
+        for (size_t i = 0; i < runners; i++)
+        {
+            nets.emplace_back(new anet_type(recognition));
+        }
+        for (size_t i = 0; i < runners; i++)
+        {
+            threads.emplace_back([this, i]()
+                                 { run(*nets[i]); });
+        }
+        cout << "[FB] Batcher started, batch " << this->max_batch << ", wait " << max_wait_ms << " ms, " << runners << " runners" << endl;
+    }
+
+    ~FaceBatcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wakeup.notify_all();
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    // 提交图像块并等待对应特征
+    std::vector<matrix<float, 0, 1>> embed(std::vector<matrix<rgb_pixel>> &&chips)
+    {
+        if (chips.empty())
+        {
+            return std::vector<matrix<float, 0, 1>>();
+        }
+        std::unique_ptr<Job> job(new Job());
+        job->chips = std::move(chips);
+        job->enqueued = std::chrono::steady_clock::now();
+        std::future<std::vector<matrix<float, 0, 1>>> result = job->result.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue_chips += job->chips.size();
+            queue.push_back(std::move(job));
+        }
+        wakeup.notify_all();
+        FaceTimer timer(FaceMetrics::BATCH_WAIT);
+        return result.get();
+    }
+
+    Stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return Stats{queue.size(), queue_chips, total_requests, total_batches, total_chips, largest_batch, histogram};
+    }
+
+private:
+    struct Job
+    {
+        std::vector<matrix<rgb_pixel>> chips;
+        std::chrono::steady_clock::time_point enqueued;
+        std::promise<std::vector<matrix<float, 0, 1>>> result;
+    };
+
+    void run(anet_type &net)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wakeup.wait(lock, [this]()
+                        { return stop || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            // 未凑满时等到最早请求的截止时间
+            std::chrono::steady_clock::time_point deadline = queue.front()->enqueued + max_wait;
+            wakeup.wait_until(lock, deadline, [this]()
+                              { return stop || queue.empty() || queue_chips >= max_batch; });
+            if (queue.empty())
+            {
+                continue;
+            }
+            std::vector<std::unique_ptr<Job>> batch;
+            size_t count = 0;
+            while (!queue.empty() && (batch.empty() || count + queue.front()->chips.size() <= max_batch))
+            {
+                count += queue.front()->chips.size();
+                queue_chips -= queue.front()->chips.size();
+                batch.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            lock.unlock();
+            forward(net, batch, count);
+            lock.lock();
+            total_requests += batch.size();
+            total_batches++;
+            total_chips += count;
+            largest_batch = std::max(largest_batch, count);
+            for (auto &bucket : histogram)
+            {
+                if (count <= bucket.first || &bucket == &histogram.back())
+                {
+                    bucket.second++;
+                    break;
+                }
+            }
+        }
+    }
+
+    // 合并为一次前向计算并分发结果
+    void forward(anet_type &net, std::vector<std::unique_ptr<Job>> &batch, size_t count)
+    {
+        std::vector<matrix<rgb_pixel>> chips;
+        chips.reserve(count);
+        for (auto &job : batch)
+        {
+            std::move(job->chips.begin(), job->chips.end(), std::back_inserter(chips));
+        }
+        try
+        {
+            std::vector<matrix<float, 0, 1>> descriptors;
+            {
+                FaceTimer timer(FaceMetrics::EMBED);
+                descriptors = net(chips, count);
+            }
+            size_t offset = 0;
+            for (auto &job : batch)
+            {
+                size_t size = job->chips.size();
+                job->result.set_value(std::vector<matrix<float, 0, 1>>(descriptors.begin() + offset, descriptors.begin() + offset + size));
+                offset += size;
+            }
+        }
+        catch (...)
+        {
+            for (auto &job : batch)
+            {
+                job->result.set_exception(std::current_exception());
+            }
+        }
+    }
+
+private:
+    size_t max_batch;
+    std::chrono::milliseconds max_wait;
+    std::vector<std::unique_ptr<anet_type>> nets;
+    std::vector<std::thread> threads;
+    mutable std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<std::unique_ptr<Job>> queue;
+    size_t queue_chips = 0;
+    bool stop = false;
+    uint64_t total_requests = 0;
+    uint64_t total_batches = 0;
+    uint64_t total_chips = 0;
+    size_t largest_batch = 0;
+    std::vector<std::pair<size_t, uint64_t>> histogram;
+};
@@ -0,0 +1,145 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-16
+// License: AGPL-3.0
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <dlib/geometry.h>
+#include <dlib/matrix.h>
+#include "face_distance.h"
+
+using namespace dlib;
+using namespace std;
+
+/*
+人脸特征缓存
+--------------------
+以上传内容的 64 位哈希为键, 缓存检测到的人脸位置与特征
+条目同时保存原始内容, 命中时逐字节比对, 哈希碰撞(包括刻意构造的)不会返回其他图片的结果
+同一张图片重复上传时只需一次哈希、查表和比对, 跳过解码、检测与特征提取
+按 LRU 淘汰, 总占用(含原始内容)不超过配置的内存预算
+*/
+class FaceCache
+{
+public:
+    struct Stats
+    {
+        size_t entries;
+        size_t bytes;
+        size_t budget;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+
+    explicit FaceCache(size_t budget_bytes) : budget(budget_bytes) {}
+
+    // 内容哈希(按 8 字节步长混合, 尾部逐字节补齐)
+    static uint64_t hash(const std::string &data)
+    {
+        uint64_t h = 1469598103934665603ULL ^ (data.size() * 0x9e3779b97f4a7c15ULL);
+        const char *p = data.data();
+        size_t words = data.size() / 8;
+        for (size_t i = 0; i < words; i++)
+        {
+            uint64_t word;
+            std::memcpy(&word, p + i * 8, 8);
+            h = (h ^ word) * 0x100000001b3ULL;
+            h ^= h >> 29;
+        }
+        for (size_t i = words * 8; i < data.size(); i++)
+        {
+            h = (h ^ static_cast<unsigned char>(p[i])) * 0x100000001b3ULL;
+        }
+        h ^= h >> 32;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // 查找缓存, 内容一致时输出人脸位置与特征并移到最近使用位置
+    bool get(uint64_t key, const std::string &data, std::vector<matrix<float, 0, 1>> &descriptors, std::vector<rectangle> *boxes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(key);
+        if (found == index.end() || found->second->data != data)
+        {
+            misses++;
+            return false;
+        }
+        entries.splice(entries.begin(), entries, found->second);
+        descriptors = found->second->descriptors;
+        if (boxes)
+        {
+            *boxes = found->second->boxes;
+        }
+        hits++;
+        return true;
+    }
+
+    // 写入缓存, 超出预算时淘汰最久未使用的条目
+    void put(uint64_t key, const std::string &data, const std::vector<matrix<float, 0, 1>> &descriptors, const std::vector<rectangle> &boxes)
+    {
+        size_t bytes = sizeof(Entry) + ENTRY_OVERHEAD + data.size() + descriptors.size() * FACE_DIM * sizeof(float) + boxes.size() * sizeof(rectangle);
+        if (bytes > budget)
+        {
+            return;
+        }
+        Entry entry{key, data, descriptors, boxes, bytes};
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = index.find(key);
+        if (found != index.end())
+        {
+            used -= found->second->bytes;
+            entries.erase(found->second);
+            index.erase(found);
+        }
+        used += entry.bytes;
+        entries.push_front(std::move(entry));
+        index[key] = entries.begin();
+        while (used > budget && !entries.empty())
+        {
+            used -= entries.back().bytes;
+            index.erase(entries.back().key);
+            entries.pop_back();
+            evictions++;
+        }
+    }
+
+    Stats stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return Stats{entries.size(), used, budget, hits, misses, evictions};
+    }
+
+private:
+    // 链表节点与哈希表项的估算开销
+    static const size_t ENTRY_OVERHEAD = 64;
+
+    struct Entry
+    {
+        uint64_t key;
+        // 原始内容, 命中时比对
+        std::string data;
+        std::vector<matrix<float, 0, 1>> descriptors;
+        std::vector<rectangle> boxes;
+        size_t bytes;
+    };
+
+    std::mutex mutex;
+    size_t budget;
+    size_t used = 0;
+    // 最近使用的在前
+    std::list<Entry> entries;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
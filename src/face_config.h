@@ -0,0 +1,142 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-06
+// License: AGPL-3.0
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+/*
+服务配置
+--------------------
+全部从环境变量读取, 未设置时使用默认值, 便于 Docker 部署时通过 -e 调整
+*/
+struct FaceConfig
+{
+    // 推理副本数(默认为 CPU 核数)
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    // 跨请求合批等待窗口(毫秒, 0 为不合批)
+    size_t batch_wait_ms = 0;
+    // 合批最大图像块数
+    size_t batch_size = 32;
+    // 合批前向计算线程数(每个线程持有一份识别网络)
+    size_t batch_runners = 1;
+    // 特征缓存内存预算(MB, 0 为不缓存)
+    size_t cache_mb = 64;
+    // 检索模式: exact 精确扫描 / ivf 近似检索
+    std::string search_mode = "exact";
+    // IVF 倒排列表数
+    size_t ivf_lists = 1024;
+    // IVF 每次检索的列表数
+    size_t ivf_probes = 16;
+    // IVF 索引文件
+    std::string ivf_path = "data/face.ivf";
+    // IVF 索引落盘间隔(秒)
+    size_t ivf_save_interval = 60;
+    // 人脸库量化编码: none / int8 / fp16
+    std::string quant_mode = "none";
+    // 量化扫描后用全精度特征重排的候选数下限
+    size_t quant_rerank = 32;
+    // 启用量化时全精度特征矩阵是否映射到数据目录下的临时文件
+    bool quant_spill = true;
+    // 关键点模型档位: 68 点 / 5 点
+    std::string landmark_profile = "68";
+    // 关键点模型文件(为空时按档位取 model/predictor.dat 或 model/predictor_5.dat)
+    std::string landmark_path;
+    // 检测图宽度(像素), 更宽的图片先缩小再检测, 0 为不缩小
+    size_t detect_width = 360;
+    // HOG 检测前的上采样次数(每次放大 2 倍, 可检出更小的人脸, 最多 2)
+    size_t detect_upsample = 0;
+    // 单次检测并行扫描图像金字塔的线程数(1 为单线程)
+    size_t detect_threads = 1;
+    // 人脸图像块是否转为灰度(与早期按灰度图提取的特征保持一致)
+    bool chip_gray = true;
+    // 上传图片最大像素数, 超出时只读文件头即拒绝
+    size_t max_image_pixels = 4096 * 4096;
+    // 人脸库快照重写间隔(秒, 0 为不写快照)
+    size_t snapshot_interval = 300;
+    // 视频流会话每隔多少帧运行一次人脸检测
+    size_t stream_detect_every = 10;
+    // 视频流会话空闲超时(秒)
+    size_t stream_idle_s = 60;
+    // 异步任务工作线程数(默认与推理副本数相同)
+    size_t job_workers = 0;
+    // 异步任务队列最大排队数
+    size_t job_queue = 256;
+    // 异步任务完成后结果保留时长(秒)
+    size_t job_ttl_s = 300;
+    // 写线程单个事务最多合并的写操作数
+    size_t db_group_size = 256;
+    // 是否写出预处理后的调试预览图 data/preview.jpg
+    bool debug_preview = false;
+
+    // 全局配置(首次访问时读取环境变量)
+    static const FaceConfig &get()
+    {
+        static const FaceConfig config = load();
+        return config;
+    }
+
+    static FaceConfig load()
+    {
+        FaceConfig config;
+        config.workers = std::max<size_t>(1, envSize("FACE_WORKERS", config.workers));
+        config.batch_wait_ms = envSize("FACE_BATCH_WAIT_MS", config.batch_wait_ms);
+        config.batch_size = envSize("FACE_BATCH_SIZE", config.batch_size);
+        config.batch_runners = envSize("FACE_BATCH_RUNNERS", config.batch_runners);
+        config.cache_mb = envSize("FACE_CACHE_MB", config.cache_mb);
+        config.search_mode = envString("FACE_SEARCH_MODE", config.search_mode);
+        config.ivf_lists = envSize("FACE_IVF_LISTS", config.ivf_lists);
+        config.ivf_probes = envSize("FACE_IVF_PROBES", config.ivf_probes);
+        config.ivf_path = envString("FACE_IVF_PATH", config.ivf_path);
+        config.ivf_save_interval = envSize("FACE_IVF_SAVE_INTERVAL", config.ivf_save_interval);
+        config.quant_mode = envString("FACE_QUANT", config.quant_mode);
+        config.quant_rerank = std::max<size_t>(1, envSize("FACE_QUANT_RERANK", config.quant_rerank));
+        config.quant_spill = envSize("FACE_QUANT_SPILL", 1) != 0;
+        config.landmark_profile = envString("FACE_LANDMARK_PROFILE", config.landmark_profile);
+        config.landmark_path = envString("FACE_LANDMARK_PATH", config.landmark_path);
+        config.detect_width = envSize("FACE_DETECT_WIDTH", config.detect_width);
+        config.detect_upsample = std::min<size_t>(2, envSize("FACE_DETECT_UPSAMPLE", config.detect_upsample));
+        config.detect_threads = std::max<size_t>(1, envSize("FACE_DETECT_THREADS", config.detect_threads));
+        config.chip_gray = envSize("FACE_CHIP_GRAY", 1) != 0;
+        config.max_image_pixels = envSize("FACE_MAX_IMAGE_PIXELS", config.max_image_pixels);
+        config.snapshot_interval = envSize("FACE_SNAPSHOT_INTERVAL", config.snapshot_interval);
+        config.stream_detect_every = std::max<size_t>(1, envSize("FACE_STREAM_DETECT_EVERY", config.stream_detect_every));
+        config.stream_idle_s = envSize("FACE_STREAM_IDLE_S", config.stream_idle_s);
+        config.job_workers = envSize("FACE_JOB_WORKERS", config.workers);
+        config.job_queue = envSize("FACE_JOB_QUEUE", config.job_queue);
+        config.job_ttl_s = envSize("FACE_JOB_TTL_S", config.job_ttl_s);
+        config.db_group_size = envSize("FACE_DB_GROUP_SIZE", config.db_group_size);
+        config.debug_preview = envSize("FACE_DEBUG_PREVIEW", 0) != 0;
+        return config;
+    }
+
+    static std::string envString(const char *name, const std::string &def)
+    {
+        const char *value = std::getenv(name);
+        return value && *value ? std::string(value) : def;
+    }
+
+    static size_t envSize(const char *name, size_t def)
+    {
+        const char *value = std::getenv(name);
+        if (!value || !*value)
+        {
+            return def;
+        }
+        try
+        {
+            return std::stoul(value);
+        }
+        catch (const std::exception &e)
+        {
+            cout << "[CF] Invalid " << name << ", use default " << def << endl;
+            return def;
+        }
+    }
+};
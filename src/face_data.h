@@ -3,31 +3,96 @@
 // License: AGPL-3.0
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <limits>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <sqlite3.h>
 #include "../nlohmann/json.hpp"
 #include <dlib/image_processing.h>
+#include "face_config.h"
+#include "face_gallery.h"
+#include "face_metrics.h"
+#include "face_snapshot.h"
 
 using json = nlohmann::json;
 
 using namespace dlib;
 using namespace std;
 
+/*
+人脸数据存储
+--------------------
+数据库使用 WAL 模式: 写入由单独的写线程串行执行, 队列中的插入与删除合并为一个事务提交(组提交)
+查询使用独立的只读连接, 不会阻塞在写事务之后; 各连接的预编译语句复用, 不在每次调用时重新编译
+启动时优先从快照文件(数据库路径加 .snap)恢复人脸库, 只回放快照之后变更日志中的行, 后台定期重写快照
+变更日志(face_log)由触发器在每次插入与删除时追加, 其他进程(如导入工具)的写入同样记录
+人脸按分组(group)划分为独立的内存分区, uid 在分组内唯一, 匹配只扫描所属分组
+*/
 class FaceData
 {
 public:
-    FaceData() : db(nullptr)
+    /*
+    path        数据库文件
+    maintain    是否启动后台维护(IVF 索引训练与落盘、快照重写)
+                离线工具与服务共用同一数据库时应关闭, 避免两个进程互相覆盖快照与索引文件
+    */
+    explicit FaceData(const std::string &path = "data/face.store", bool maintain = true)
+        : path(path), snapshot_path(path + ".snap"), maintain(maintain), db(nullptr)
     {
-        if (sqlite3_open("data/face.store", &db) != SQLITE_OK)
+        if (sqlite3_open(path.c_str(), &db) != SQLITE_OK)
         {
             cout << "[DB] Database startup failed" << endl;
+            sqlite3_close(db);
             db = nullptr;
         }
     }
 
     ~FaceData()
     {
+        // 停止写线程(退出前写完队列中的操作)
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            write_stop = true;
+        }
+        write_cv.notify_all();
+        if (writer.joinable())
+        {
+            writer.join();
+        }
+        // 停止索引与快照维护线程
+        {
+            std::lock_guard<std::mutex> lock(maintain_mutex);
+            maintain_stop = true;
+        }
+        maintain_cv.notify_all();
+        if (index_worker.joinable())
+        {
+            index_worker.join();
+        }
+        if (snapshot_worker.joinable())
+        {
+            snapshot_worker.join();
+        }
+        readers.clear();
+        sqlite3_finalize(insert_stmt);
+        sqlite3_finalize(delete_stmt);
+        sqlite3_finalize(log_seq_stmt);
+        sqlite3_finalize(prune_stmt);
         if (db)
         {
             // 关闭数据库
@@ -39,6 +104,8 @@ public:
     {
         std::string uid;
         matrix<float, 0, 1> face;
+        // 所属分组, 空字符串为默认分组
+        std::string group;
     };
 
     // 初始化数据库
@@ -49,174 +116,1167 @@ public:
             cout << "[DB] Database not started" << endl;
             return false;
         }
+        // 启用 WAL, 读连接与写事务互不阻塞
+        if (sqlite3_exec(db, "PRAGMA journal_mode=WAL;", 0, 0, 0) != SQLITE_OK)
+        {
+            cout << "[DB] WAL mode unavailable" << endl;
+        }
+        sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
         // 检查人脸表是否存在
-        int column_count;
         int state = sqlite3_table_column_metadata(db, nullptr, "face", nullptr, nullptr, nullptr, nullptr, nullptr, nullptr);
-        if (state == 0)
+        if (state != 0)
+        {
+            // 创建人脸表
+            state = sqlite3_exec(db, createTableSql("face").c_str(), 0, 0, 0);
+            if (state != SQLITE_OK)
+            {
+                return false;
+            }
+        }
+        // 旧版文本特征表迁移为二进制格式
+        else if (sqlite3_table_column_metadata(db, nullptr, "face", "format", nullptr, nullptr, nullptr, nullptr, nullptr) != SQLITE_OK)
+        {
+            if (!migrateTextFormat())
+            {
+                cout << "[DB] Face table migration failed" << endl;
+                return false;
+            }
+        }
+        // 旧表补充分组字段
+        if (sqlite3_table_column_metadata(db, nullptr, "face", "group", nullptr, nullptr, nullptr, nullptr, nullptr) != SQLITE_OK &&
+            sqlite3_exec(db, "ALTER TABLE face ADD COLUMN \"group\" TEXT NOT NULL DEFAULT '';", 0, 0, 0) != SQLITE_OK)
+        {
+            cout << "[DB] Face group column creation failed" << endl;
+            return false;
+        }
+        // 分组内 uid 唯一索引
+        if (!ensureUidIndex())
+        {
+            cout << "[DB] Face uid index creation failed" << endl;
+            return false;
+        }
+        // 变更日志(快照据此回放)
+        if (!ensureChangeLog())
+        {
+            cout << "[DB] Face change log creation failed" << endl;
+            return false;
+        }
+        // 按配置启用量化编码(需在加载人脸库之前)
+        startQuantization();
+        // 加载常驻人脸库
+        snapshot_enabled = maintain && FaceConfig::get().snapshot_interval > 0;
+        loadGallery();
+        // 启动写线程
+        if (!startWriter())
+        {
+            cout << "[DB] Writer startup failed" << endl;
+            return false;
+        }
+        // 按配置启用近似索引
+        if (maintain && FaceConfig::get().search_mode == "ivf")
+        {
+            startIndex();
+        }
+        // 定期重写快照
+        if (snapshot_enabled)
+        {
+            snapshot_worker = std::thread([this]()
+                                          { maintainSnapshot(); });
+        }
+        return true;
+    }
+
+    // 分组的常驻内存人脸库(分组不存在时返回空库, 不创建分组)
+    const FaceGallery &gallery(const std::string &group = "") const
+    {
+        const FaceGallery *found = findPartition(group);
+        if (!found)
+        {
+            static const FaceGallery empty_gallery;
+            return empty_gallery;
+        }
+        return *found;
+    }
+
+    // 各分组人脸数
+    std::vector<std::pair<std::string, size_t>> groupSizes() const
+    {
+        std::vector<std::pair<std::string, size_t>> sizes;
+        for (const auto &item : partitionList())
+        {
+            sizes.push_back(std::make_pair(item.first, item.second->size()));
+        }
+        return sizes;
+    }
+
+    // 全部分组的特征内存占用
+    FaceGallery::Footprint footprint() const
+    {
+        FaceGallery::Footprint total{0, 0};
+        for (const auto &item : partitionList())
+        {
+            FaceGallery::Footprint part = item.second->footprint();
+            total.float_bytes += part.float_bytes;
+            total.code_bytes += part.code_bytes;
+        }
+        return total;
+    }
+
+    // 量化编码模式
+    FaceQuant::Mode quantMode() const
+    {
+        return quant_mode;
+    }
+
+    // 全精度特征矩阵是否映射到文件
+    bool spilled() const
+    {
+        return spill_enabled;
+    }
+
+    // 全部分组人脸总数
+    size_t size() const
+    {
+        size_t total = 0;
+        for (const auto &item : partitionList())
+        {
+            total += item.second->size();
+        }
+        return total;
+    }
+
+    // 保存人脸数据(等待所在组提交完成后返回)
+    bool save(const std::string &uid, const matrix<float, 0, 1> &face_descriptor, const std::string &group = "")
+    {
+        FaceTimer timer(FaceMetrics::DB_WRITE);
+        std::unique_ptr<WriteOp> op(new WriteOp());
+        op->insert = true;
+        op->objs.push_back(FaceObject{uid, face_descriptor, group});
+        return submit(std::move(op));
+    }
+
+    // 批量保存人脸数据(同一批内任一失败则整批回滚)
+    bool saveBatch(const std::vector<FaceObject> &objs)
+    {
+        if (objs.empty())
         {
             return true;
         }
-        // 创建人脸表
-        const char *create_table_sql = "CREATE TABLE face (\"id\" INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,\"uid\" TEXT NOT NULL,\"face\" TEXT NOT NULL );";
-        state = sqlite3_exec(db, create_table_sql, 0, 0, 0);
-        return state == SQLITE_OK;
+        FaceTimer timer(FaceMetrics::DB_WRITE);
+        std::unique_ptr<WriteOp> op(new WriteOp());
+        op->insert = true;
+        op->objs = objs;
+        return submit(std::move(op));
     }
 
-    // 保存人脸数据
-    bool save(const std::string &uid, const matrix<float, 0, 1> &face_descriptor)
+    /*
+    逐条保存人脸数据
+    -----------------
+    全部条目在同一事务中提交, 每条包在各自的保存点内, 某条失败(如 uid 重复)只回滚该条
+    返回与 objs 一一对应的保存结果
+    */
+    std::vector<bool> saveEach(const std::vector<FaceObject> &objs)
     {
+        if (objs.empty())
+        {
+            return std::vector<bool>();
+        }
+        FaceTimer timer(FaceMetrics::DB_WRITE);
+        std::unique_ptr<WriteOp> op(new WriteOp());
+        op->insert = true;
+        op->objs = objs;
+        // 写线程在通知完成前写好逐条结果, 操作对象随后由写线程释放
+        std::shared_ptr<std::vector<char>> rows = std::make_shared<std::vector<char>>(objs.size(), 0);
+        op->row_results = rows;
+        submit(std::move(op));
+        return std::vector<bool>(rows->begin(), rows->end());
+    }
+
+    // 删除人脸数据
+    bool remove(const std::string &uid, const std::string &group = "")
+    {
+        FaceTimer timer(FaceMetrics::DB_WRITE);
+        std::unique_ptr<WriteOp> op(new WriteOp());
+        op->insert = false;
+        op->uid = uid;
+        op->group = group;
+        return submit(std::move(op));
+    }
+
+    // 查询uid是否存在(查内存库, 不访问数据库)
+    bool exists(const std::string &uid, const std::string &group = "")
+    {
+        return gallery(group).contains(uid);
+    }
+
+    // 是否为小端主机
+    static bool littleEndian()
+    {
+        const uint16_t probe = 1;
+        return *reinterpret_cast<const uint8_t *>(&probe) == 1;
+    }
+
+    // 特征转为 512 字节 float32 小端二进制
+    static std::string descriptorToBlob(const matrix<float, 0, 1> &face)
+    {
+        std::string blob(FACE_DIM * sizeof(float), '\0');
+        std::memcpy(&blob[0], &face(0), blob.size());
+        if (!littleEndian())
+        {
+            for (size_t i = 0; i < blob.size(); i += sizeof(float))
+            {
+                std::reverse(blob.begin() + i, blob.begin() + i + sizeof(float));
+            }
+        }
+        return blob;
+    }
+
+    // 二进制特征直接拷入目标内存, 长度不符返回 false
+    static bool blobToDescriptor(const void *blob, int bytes, float *out)
+    {
+        if (!blob || bytes != static_cast<int>(FACE_DIM * sizeof(float)))
+        {
+            return false;
+        }
+        std::memcpy(out, blob, FACE_DIM * sizeof(float));
+        if (!littleEndian())
+        {
+            unsigned char *raw = reinterpret_cast<unsigned char *>(out);
+            for (size_t i = 0; i < FACE_DIM * sizeof(float); i += sizeof(float))
+            {
+                std::reverse(raw + i, raw + i + sizeof(float));
+            }
+        }
+        return true;
+    }
+
+    // 获取全部列表
+    std::vector<FaceObject> all_list()
+    {
+        FaceTimer timer(FaceMetrics::DB_READ);
+        std::vector<FaceObject> obj_list;
+        ReaderLease reader(*this);
+        sqlite3_stmt *stmt = reader.prepare(&Reader::list_stmt, "SELECT \"uid\", \"face\", \"group\" FROM \"face\" WHERE \"format\" = ?;");
+        if (!stmt)
+        {
+            return obj_list;
+        }
+        sqlite3_bind_int(stmt, 1, FORMAT_BLOB);
+
+        // 逐行获取数据
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            FaceObject obj;
+            obj.face.set_size(FACE_DIM);
+            // 直接读取二进制特征, 长度不符的行跳过
+            if (!blobToDescriptor(sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1), &obj.face(0)))
+            {
+                continue;
+            }
+            // 获取标识符
+            obj.uid = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+            obj.group = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2));
+            // 添加到列表
+            obj_list.push_back(std::move(obj));
+        }
+        sqlite3_reset(stmt);
+        return obj_list;
+    }
+
+private:
+    // 特征存储格式: 0 逗号分隔文本(旧版), 1 float32 小端二进制
+    static const int FORMAT_TEXT = 0;
+    static const int FORMAT_BLOB = 1;
+    // 连接被锁时的等待时间(毫秒)
+    static const int BUSY_TIMEOUT_MS = 5000;
+
+    // 写操作(插入一组人脸或按分组与 uid 删除), 由写线程按入队顺序执行
+    struct WriteOp
+    {
+        bool insert = true;
+        std::vector<FaceObject> objs;
+        // 非空时逐条保存(每条一个保存点), 记录每条是否成功
+        std::shared_ptr<std::vector<char>> row_results;
+        std::string uid;
+        std::string group;
+        std::promise<bool> done;
+    };
+
+    // 只读连接及其预编译语句
+    struct Reader
+    {
+        sqlite3 *db = nullptr;
+        sqlite3_stmt *list_stmt = nullptr;
+
+        ~Reader()
+        {
+            sqlite3_finalize(list_stmt);
+            sqlite3_close(db);
+        }
+    };
+
+    // 读连接租约, 析构时归还连接池
+    class ReaderLease
+    {
+    public:
+        explicit ReaderLease(FaceData &owner) : owner(owner), reader(owner.acquireReader()) {}
+
+        ~ReaderLease()
+        {
+            if (reader)
+            {
+                owner.releaseReader(std::move(reader));
+            }
+        }
+
+        // 取缓存的预编译语句, 首次使用时编译
+        sqlite3_stmt *prepare(sqlite3_stmt *Reader::*slot, const char *sql)
+        {
+            if (!reader)
+            {
+                return nullptr;
+            }
+            sqlite3_stmt *&stmt = reader.get()->*slot;
+            if (!stmt && sqlite3_prepare_v2(reader->db, sql, -1, &stmt, 0) != SQLITE_OK)
+            {
+                sqlite3_finalize(stmt);
+                stmt = nullptr;
+                return nullptr;
+            }
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+            return stmt;
+        }
+
+    private:
+        FaceData &owner;
+        std::unique_ptr<Reader> reader;
+    };
+
+    // 取一个空闲读连接, 没有时新建
+    std::unique_ptr<Reader> acquireReader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(reader_mutex);
+            if (!readers.empty())
+            {
+                std::unique_ptr<Reader> reader = std::move(readers.back());
+                readers.pop_back();
+                return reader;
+            }
+        }
         if (!db)
         {
             cout << "[DB] Database not started" << endl;
+            return nullptr;
+        }
+        std::unique_ptr<Reader> reader(new Reader());
+        if (sqlite3_open_v2(path.c_str(), &reader->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK)
+        {
+            cout << "[DB] Reader connection failed" << endl;
+            return nullptr;
+        }
+        sqlite3_busy_timeout(reader->db, BUSY_TIMEOUT_MS);
+        return reader;
+    }
+
+    void releaseReader(std::unique_ptr<Reader> reader)
+    {
+        std::lock_guard<std::mutex> lock(reader_mutex);
+        readers.push_back(std::move(reader));
+    }
+
+    // 编译写语句并启动写线程
+    bool startWriter()
+    {
+        if (sqlite3_prepare_v2(db, "INSERT INTO face (\"uid\", \"face\", \"format\", \"group\") VALUES (?,?,?,?);", -1, &insert_stmt, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "DELETE FROM face WHERE \"group\" = ? AND \"uid\" = ?;", -1, &delete_stmt, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "DELETE FROM face_log WHERE \"seq\" <= ?;", -1, &prune_stmt, 0) != SQLITE_OK)
+        {
             return false;
         }
+        writer = std::thread([this]()
+                             { writeLoop(); });
+        return true;
+    }
+
+    // 提交写操作并等待结果
+    bool submit(std::unique_ptr<WriteOp> op)
+    {
+        std::future<bool> done = op->done.get_future();
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            if (!writer.joinable() || write_stop)
+            {
+                cout << "[DB] Database not started" << endl;
+                return false;
+            }
+            write_queue.push_back(std::move(op));
+        }
+        write_cv.notify_one();
+        return done.get();
+    }
+
+    // 写线程: 每次取出队列中已有的操作(至多 db_group_size 个)作为一组提交
+    void writeLoop()
+    {
+        size_t group_size = std::max<size_t>(1, FaceConfig::get().db_group_size);
+        std::vector<std::unique_ptr<WriteOp>> ops;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(write_mutex);
+                write_cv.wait(lock, [this]()
+                              { return write_stop || !write_queue.empty(); });
+                if (write_queue.empty())
+                {
+                    break;
+                }
+                while (!write_queue.empty() && ops.size() < group_size)
+                {
+                    ops.push_back(std::move(write_queue.front()));
+                    write_queue.pop_front();
+                }
+            }
+            commitGroup(ops);
+            ops.clear();
+        }
+    }
+
+    /*
+    组提交
+    -----------------
+    一组操作共用一个事务(一次 fsync), 每个操作包在保存点内, 失败时只回滚该操作
+    事务提交成功后按入队顺序更新内存库, 再通知各请求线程
+    事务持有写锁, 期间追加的日志序号连续且都属于本进程; 事务开始时的序号与已应用序号不一致说明其他进程写入过
+    */
+    void commitGroup(std::vector<std::unique_ptr<WriteOp>> &ops)
+    {
+        std::vector<char> results(ops.size(), 0);
+        int64_t seq_before = -1;
+        int64_t seq_after = -1;
+        int64_t prune_to = -1;
+        if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) == SQLITE_OK)
+        {
+            seq_before = logSeq(log_seq_stmt);
+            // 清理已无需回放的日志: 快照开启时清到最近一次落盘的快照序号, 关闭时全部清理; 不维护快照的进程(导入工具)不清理
+            int64_t prune = !maintain ? 0 : snapshot_enabled ? saved_seq.load() : seq_before;
+            if (prune > pruned_seq)
+            {
+                sqlite3_reset(prune_stmt);
+                sqlite3_bind_int64(prune_stmt, 1, prune);
+                prune_to = sqlite3_step(prune_stmt) == SQLITE_DONE ? prune : -1;
+                sqlite3_reset(prune_stmt);
+            }
+            for (size_t i = 0; i < ops.size(); i++)
+            {
+                if (sqlite3_exec(db, "SAVEPOINT op;", 0, 0, 0) != SQLITE_OK)
+                {
+                    continue;
+                }
+                results[i] = ops[i]->insert ? executeInsert(ops[i]->objs, ops[i]->row_results.get())
+                                            : executeDelete(ops[i]->group, ops[i]->uid);
+                if (!results[i])
+                {
+                    sqlite3_exec(db, "ROLLBACK TO op;", 0, 0, 0);
+                }
+                sqlite3_exec(db, "RELEASE op;", 0, 0, 0);
+            }
+            seq_after = logSeq(log_seq_stmt);
+            if (sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK)
+            {
+                sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+                std::fill(results.begin(), results.end(), 0);
+                seq_after = -1;
+            }
+        }
+        if (seq_after >= 0 && prune_to > pruned_seq)
+        {
+            pruned_seq = prune_to;
+        }
+        // 整个操作未生效时逐条结果一并作废
+        for (size_t i = 0; i < ops.size(); i++)
+        {
+            if (!results[i] && ops[i]->row_results)
+            {
+                std::fill(ops[i]->row_results->begin(), ops[i]->row_results->end(), 0);
+            }
+        }
+        for (size_t i = 0; i < ops.size(); i++)
+        {
+            if (results[i])
+            {
+                if (ops[i]->insert)
+                {
+                    size_t added = 0;
+                    for (size_t r = 0; r < ops[i]->objs.size(); r++)
+                    {
+                        if (!ops[i]->row_results || (*ops[i]->row_results)[r])
+                        {
+                            partition(ops[i]->objs[r].group).add(ops[i]->objs[r].uid, ops[i]->objs[r].face);
+                            added++;
+                        }
+                    }
+                    if (ops[i]->objs.size() == 1)
+                    {
+                        cout << "[DB] Add face data UID-" << ops[i]->objs[0].uid << endl;
+                    }
+                    else
+                    {
+                        cout << "[DB] Add " << added << " face data in batch" << endl;
+                    }
+                }
+                else if (FaceGallery *gallery = findPartition(ops[i]->group))
+                {
+                    // 只在已有分组中删除, 不存在的分组不会因删除请求被创建
+                    gallery->remove(ops[i]->uid);
+                }
+            }
+            ops[i]->done.set_value(results[i] != 0);
+        }
+        // 写入内存库后推进已应用序号; 出现其他进程的写入后不再推进, 之后的快照从缺口处回放
+        if (seq_after >= 0 && seq_before >= 0)
+        {
+            if (seq_before == applied_seq.load())
+            {
+                applied_seq.store(seq_after);
+            }
+            else if (!log_gap)
+            {
+                log_gap = true;
+                cout << "[DB] Rows written by another process after log SEQ-" << applied_seq.load() << ", snapshots replay from there until restart" << endl;
+            }
+        }
+    }
+
+    /*
+    插入一组人脸
+    -----------------
+    row_results 为空时任一条失败即整体失败(由调用方回滚)
+    否则每条包在保存点内, 失败只回滚该条并记入 row_results, 至少一条成功时返回 true
+    */
+    bool executeInsert(const std::vector<FaceObject> &objs, std::vector<char> *row_results = nullptr)
+    {
+        bool any = false;
+        for (size_t r = 0; r < objs.size(); r++)
+        {
+            const FaceObject &obj = objs[r];
+            if (row_results && sqlite3_exec(db, "SAVEPOINT row;", 0, 0, 0) != SQLITE_OK)
+            {
+                continue;
+            }
+            std::string blob = descriptorToBlob(obj.face);
+            sqlite3_reset(insert_stmt);
+            bool ok = sqlite3_bind_text(insert_stmt, 1, obj.uid.c_str(), -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+                      sqlite3_bind_blob(insert_stmt, 2, blob.data(), blob.size(), SQLITE_TRANSIENT) == SQLITE_OK &&
+                      sqlite3_bind_int(insert_stmt, 3, FORMAT_BLOB) == SQLITE_OK &&
+                      sqlite3_bind_text(insert_stmt, 4, obj.group.c_str(), -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+                      sqlite3_step(insert_stmt) == SQLITE_DONE;
+            any = any || ok;
+            if (!row_results)
+            {
+                if (!ok)
+                {
+                    sqlite3_reset(insert_stmt);
+                    return false;
+                }
+                continue;
+            }
+            sqlite3_reset(insert_stmt);
+            if (!ok)
+            {
+                sqlite3_exec(db, "ROLLBACK TO row;", 0, 0, 0);
+            }
+            sqlite3_exec(db, "RELEASE row;", 0, 0, 0);
+            (*row_results)[r] = ok;
+        }
+        sqlite3_reset(insert_stmt);
+        return row_results ? any : true;
+    }
 
-        const char *insert_sql = "INSERT INTO face (\"uid\", \"face\") VALUES (?,?);";
+    bool executeDelete(const std::string &group, const std::string &uid)
+    {
+        sqlite3_reset(delete_stmt);
+        bool ok = sqlite3_bind_text(delete_stmt, 1, group.c_str(), -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+                  sqlite3_bind_text(delete_stmt, 2, uid.c_str(), -1, SQLITE_TRANSIENT) == SQLITE_OK &&
+                  sqlite3_step(delete_stmt) == SQLITE_DONE;
+        sqlite3_reset(delete_stmt);
+        return ok;
+    }
 
+    static std::string createTableSql(const std::string &name)
+    {
+        return "CREATE TABLE \"" + name + "\" (\"id\" INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,\"uid\" TEXT NOT NULL,\"face\" BLOB NOT NULL,\"format\" INTEGER NOT NULL DEFAULT 1,\"group\" TEXT NOT NULL DEFAULT '' );";
+    }
+
+    /*
+    创建分组内 uid 唯一索引
+    -----------------
+    旧库可能存在重复 uid, 建索引前在同一事务内去重, 每个分组内的 uid 保留最新(id 最大)的一行
+    旧版全局 uid 索引一并替换
+    */
+    bool ensureUidIndex()
+    {
         sqlite3_stmt *stmt;
-        int state = sqlite3_prepare_v2(db, insert_sql, -1, &stmt, 0);
-        if (state != SQLITE_OK)
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'index' AND name = 'face_group_uid';", -1, &stmt, 0) != SQLITE_OK)
         {
             return false;
         }
-        // 绑定标识符
-        state = sqlite3_bind_text(stmt, 1, uid.c_str(), -1, SQLITE_TRANSIENT);
-        if (state != SQLITE_OK)
+        bool found = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+        if (found)
         {
-            sqlite3_finalize(stmt);
-            return false;
+            return true;
         }
-        // 绑定特征数据
-        state = sqlite3_bind_text(stmt, 2, matrix_to_string(face_descriptor).c_str(), -1, SQLITE_TRANSIENT);
-        if (state != SQLITE_OK)
+        if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK)
         {
-            sqlite3_finalize(stmt);
             return false;
         }
-        // 执行语句
-        state = sqlite3_step(stmt);
-        if (state != SQLITE_DONE)
+        bool ok = sqlite3_exec(db, "DELETE FROM face WHERE \"id\" NOT IN (SELECT MAX(\"id\") FROM face GROUP BY \"group\", \"uid\");", 0, 0, 0) == SQLITE_OK;
+        int duplicates = sqlite3_changes(db);
+        ok = ok && sqlite3_exec(db, "DROP INDEX IF EXISTS face_uid;"
+                                    "CREATE UNIQUE INDEX face_group_uid ON face (\"group\", \"uid\");",
+                                0, 0, 0) == SQLITE_OK;
+        if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK)
         {
-            sqlite3_finalize(stmt);
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
             return false;
         }
-        // 完成语句
-        sqlite3_finalize(stmt);
-        cout << "[DB] Add face data UID-" << uid << endl;
+        cout << "[DB] Face uid index created, " << duplicates << " duplicate rows removed" << endl;
         return true;
     }
 
-    // 删除人脸数据
-    bool remove(const std::string &uid){
-        if (!db)
+    /*
+    创建变更日志
+    -----------------
+    face 表每次插入与删除都由触发器追加一条(id, 分组, uid), 序号自增且不复用
+    快照记录写出时已应用的日志序号, 启动时只需回放其后的日志, 不必扫描全表
+    */
+    bool ensureChangeLog()
+    {
+        bool ok = sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS face_log (\"seq\" INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT,\"id\" INTEGER NOT NULL,\"group\" TEXT NOT NULL,\"uid\" TEXT NOT NULL);"
+                                   "CREATE TRIGGER IF NOT EXISTS face_log_insert AFTER INSERT ON face BEGIN "
+                                   "INSERT INTO face_log (\"id\", \"group\", \"uid\") VALUES (NEW.\"id\", NEW.\"group\", NEW.\"uid\"); END;"
+                                   "CREATE TRIGGER IF NOT EXISTS face_log_delete AFTER DELETE ON face BEGIN "
+                                   "INSERT INTO face_log (\"id\", \"group\", \"uid\") VALUES (OLD.\"id\", OLD.\"group\", OLD.\"uid\"); END;",
+                                   0, 0, 0) == SQLITE_OK;
+        return ok && sqlite3_prepare_v2(db, "SELECT \"seq\" FROM sqlite_sequence WHERE \"name\" = 'face_log';", -1, &log_seq_stmt, 0) == SQLITE_OK;
+    }
+
+    // 已分配的最大日志序号(按自增序列取, 日志被清理后仍然准确)
+    static int64_t logSeq(sqlite3_stmt *stmt)
+    {
+        sqlite3_reset(stmt);
+        int64_t seq = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+        sqlite3_reset(stmt);
+        return seq;
+    }
+
+    // 快照序号之后的日志是否完整保留(未被清理, 且快照不晚于数据库)
+    bool logCovers(int64_t snapshot_seq, int64_t current_seq)
+    {
+        if (snapshot_seq > current_seq)
         {
-            cout << "[DB] Database not started" << endl;
             return false;
         }
-        std::string sql = "DELETE FROM face WHERE uid = '" + uid + "';";
-        int state = sqlite3_exec(db, sql.c_str(), 0, 0, 0);
-        return state == SQLITE_OK;
+        if (snapshot_seq == current_seq)
+        {
+            return true;
+        }
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, "SELECT MIN(\"seq\") FROM face_log;", -1, &stmt, 0) != SQLITE_OK)
+        {
+            return false;
+        }
+        int64_t first = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+        sqlite3_finalize(stmt);
+        return first > 0 && first <= snapshot_seq + 1;
     }
- 
-    // 查询uid是否存在
-    bool exists(const std::string &uid)
+
+    /*
+    加载常驻人脸库
+    -----------------
+    快照可用时先整块读入快照, 剔除快照序号之后日志中出现过的(分组, uid), 再按日志中的 id 读回这些键的当前行
+    快照缺失、损坏或日志已被清理时从数据库全量加载(特征直接拷入各分组的连续矩阵, 不经过中间对象)
+    序号与数据在同一读事务内读取, 内存库与序号一致
+    */
+    void loadGallery()
     {
-        if (!db)
+        FaceTimer timer(FaceMetrics::DB_READ);
+        if (maintain && !snapshot_enabled)
         {
-            cout << "[DB] Database not started" << endl;
-            return false;
+            // 关闭快照时日志不再保留, 旧快照随之作废
+            std::remove(snapshot_path.c_str());
         }
+        std::vector<FaceSnapshot::Part> snapshot;
+        int64_t snapshot_seq = 0;
+        bool from_snapshot = FaceSnapshot::load(snapshot_path, snapshot, snapshot_seq);
+        sqlite3_exec(db, "BEGIN;", 0, 0, 0);
+        int64_t current_seq = logSeq(log_seq_stmt);
+        if (from_snapshot && !logCovers(snapshot_seq, current_seq))
+        {
+            cout << "[DB] Snapshot log SEQ-" << snapshot_seq << " no longer covered by database log, full load" << endl;
+            from_snapshot = false;
+            std::vector<FaceSnapshot::Part>().swap(snapshot);
+        }
+        size_t dropped = from_snapshot ? dropLoggedRows(snapshot, snapshot_seq) : 0;
+        std::map<std::string, FaceSnapshot::Part> parts;
+        size_t snapshot_rows = 0;
+        for (FaceSnapshot::Part &part : snapshot)
+        {
+            snapshot_rows += part.uids.size();
+            std::string group = part.group;
+            parts[group] = std::move(part);
+        }
+        if (from_snapshot)
+        {
+            cout << "[DB] Snapshot loaded, " << snapshot_rows << " faces in " << parts.size() << " groups up to log SEQ-" << snapshot_seq << endl;
+        }
+        // id 不复用, 日志中已删除行的 id 查不到, 查到的即各变更键的当前行
+        const char *select_sql = from_snapshot ? "SELECT \"uid\", \"face\", \"group\" FROM \"face\" WHERE \"format\" = ? AND \"id\" IN (SELECT \"id\" FROM face_log WHERE \"seq\" > ?) ORDER BY \"id\";"
+                                               : "SELECT \"uid\", \"face\", \"group\" FROM \"face\" WHERE \"format\" = ? ORDER BY \"id\";";
+        size_t rows_read = 0;
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, 0) == SQLITE_OK)
+        {
+            sqlite3_bind_int(stmt, 1, FORMAT_BLOB);
+            if (from_snapshot)
+            {
+                sqlite3_bind_int64(stmt, 2, snapshot_seq);
+            }
+            while (sqlite3_step(stmt) == SQLITE_ROW)
+            {
+                FaceSnapshot::Part &part = parts[reinterpret_cast<const char *>(sqlite3_column_text(stmt, 2))];
+                size_t offset = part.faces.size();
+                part.faces.resize(offset + FACE_DIM);
+                if (!blobToDescriptor(sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1), part.faces.data() + offset))
+                {
+                    part.faces.resize(offset);
+                    continue;
+                }
+                part.uids.push_back(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)));
+                rows_read++;
+            }
+            sqlite3_finalize(stmt);
+        }
+        sqlite3_exec(db, "COMMIT;", 0, 0, 0);
+        snapshot_replayed = from_snapshot ? rows_read : 0;
+        snapshot_fresh = snapshot_rows > 0 && rows_read == 0 && dropped == 0;
+        for (auto &item : parts)
+        {
+            partition(item.first).reset(std::move(item.second.faces), std::move(item.second.uids));
+        }
+        applied_seq.store(current_seq);
+        saved_seq.store(from_snapshot ? snapshot_seq : 0);
+        cout << "[DB] Gallery loaded, " << size() << " faces in " << parts.size() << " groups, " << snapshot_replayed << " rows replayed, " << dropped << " snapshot rows superseded" << endl;
+    }
 
-        const char *select_sql = "SELECT COUNT(*) FROM \"face\" WHERE \"uid\" = ?;";
+    // 剔除快照序号之后日志中出现过的(分组, uid), 这些键的当前行随后按 id 读回, 返回剔除行数
+    size_t dropLoggedRows(std::vector<FaceSnapshot::Part> &parts, int64_t snapshot_seq)
+    {
+        std::unordered_set<std::string> changed;
         sqlite3_stmt *stmt;
-        int state = sqlite3_prepare_v2(db, select_sql, -1, &stmt, 0);
+        if (sqlite3_prepare_v2(db, "SELECT \"group\", \"uid\" FROM face_log WHERE \"seq\" > ?;", -1, &stmt, 0) != SQLITE_OK)
+        {
+            return 0;
+        }
+        sqlite3_bind_int64(stmt, 1, snapshot_seq);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            changed.insert(rowKey(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1))));
+        }
+        sqlite3_finalize(stmt);
+        if (changed.empty())
+        {
+            return 0;
+        }
+        size_t dropped = 0;
+        for (FaceSnapshot::Part &part : parts)
+        {
+            size_t kept = 0;
+            for (size_t i = 0; i < part.uids.size(); i++)
+            {
+                if (changed.count(rowKey(part.group, part.uids[i])))
+                {
+                    continue;
+                }
+                if (kept != i)
+                {
+                    std::copy(part.faces.begin() + i * FACE_DIM, part.faces.begin() + (i + 1) * FACE_DIM, part.faces.begin() + kept * FACE_DIM);
+                    part.uids[kept] = std::move(part.uids[i]);
+                }
+                kept++;
+            }
+            dropped += part.uids.size() - kept;
+            part.faces.resize(kept * FACE_DIM);
+            part.uids.resize(kept);
+        }
+        return dropped;
+    }
 
-        if (state != SQLITE_OK)
+    // 分组与 uid 组合键(以 \0 分隔, 分组名由接口层保证不含 \0)
+    static std::string rowKey(const std::string &group, const std::string &uid)
+    {
+        return group + '\0' + uid;
+    }
+
+    // 查找分组的人脸库, 不存在时返回空指针(删除、查询与匹配使用, 不创建分组)
+    FaceGallery *findPartition(const std::string &group) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(partition_mutex);
+        auto found = partitions.find(group);
+        return found == partitions.end() ? nullptr : found->second.get();
+    }
+
+    // 取分组的人脸库, 不存在时创建(按配置同时启用分区索引与量化编码, 只在写入人脸时调用)
+    FaceGallery &partition(const std::string &group)
+    {
         {
-            return false;
+            std::shared_lock<std::shared_timed_mutex> lock(partition_mutex);
+            auto found = partitions.find(group);
+            if (found != partitions.end())
+            {
+                return *found->second;
+            }
+        }
+        std::unique_lock<std::shared_timed_mutex> lock(partition_mutex);
+        std::unique_ptr<FaceGallery> &slot = partitions[group];
+        if (!slot)
+        {
+            slot.reset(new FaceGallery());
+            if (index_enabled)
+            {
+                const FaceConfig &config = FaceConfig::get();
+                slot->enableIndex(config.ivf_lists, config.ivf_probes);
+            }
+            if (quant_mode != FaceQuant::NONE)
+            {
+                slot->enableQuantization(quant_mode, FaceConfig::get().quant_rerank);
+            }
         }
+        return *slot;
+    }
 
-        // 绑定 uid 参数
-        state = sqlite3_bind_text(stmt, 1, uid.c_str(), -1, SQLITE_TRANSIENT);
-        if (state != SQLITE_OK)
+    // 当前全部分组(分组只增不删, 指针长期有效)
+    std::vector<std::pair<std::string, FaceGallery *>> partitionList() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(partition_mutex);
+        std::vector<std::pair<std::string, FaceGallery *>> list;
+        for (const auto &item : partitions)
         {
-            sqlite3_finalize(stmt);
-            return false;
+            list.push_back(std::make_pair(item.first, item.second.get()));
         }
+        return list;
+    }
 
-        // 执行查询
-        state = sqlite3_step(stmt);
-        if (state == SQLITE_ROW)
+    // 全部分组的变更计数之和
+    uint64_t changeCount() const
+    {
+        uint64_t changes = 0;
+        for (const auto &item : partitionList())
         {
-            int count = sqlite3_column_int(stmt, 0);
-            return count > 0;
+            changes += item.second->changeCount();
         }
-        sqlite3_finalize(stmt);
+        return changes;
+    }
 
-        return false;
+    /*
+    迁移旧版文本特征表
+    -----------------
+    在同一事务内新建二进制格式表, 逐行解析文本特征写入后替换原表
+    任一步失败则整体回滚, 原表保持不变
+    */
+    bool migrateTextFormat()
+    {
+        cout << "[DB] Migrating face table to binary format" << endl;
+        if (sqlite3_exec(db, "BEGIN IMMEDIATE;", 0, 0, 0) != SQLITE_OK)
+        {
+            return false;
+        }
+        bool ok = sqlite3_exec(db, createTableSql("face_migrate").c_str(), 0, 0, 0) == SQLITE_OK;
+        sqlite3_stmt *select_stmt = nullptr;
+        sqlite3_stmt *insert_stmt = nullptr;
+        size_t migrated = 0;
+        if (ok)
+        {
+            ok = sqlite3_prepare_v2(db, "SELECT \"id\", \"uid\", \"face\" FROM \"face\";", -1, &select_stmt, 0) == SQLITE_OK &&
+                 sqlite3_prepare_v2(db, "INSERT INTO face_migrate (\"id\", \"uid\", \"face\", \"format\") VALUES (?,?,?,?);", -1, &insert_stmt, 0) == SQLITE_OK;
+        }
+        while (ok && sqlite3_step(select_stmt) == SQLITE_ROW)
+        {
+            const char *text = reinterpret_cast<const char *>(sqlite3_column_text(select_stmt, 2));
+            matrix<float, 0, 1> face;
+            if (!text || !parseTextDescriptor(text, face))
+            {
+                cout << "[DB] Skip malformed face row ID-" << sqlite3_column_int64(select_stmt, 0) << endl;
+                continue;
+            }
+            std::string blob = descriptorToBlob(face);
+            sqlite3_reset(insert_stmt);
+            sqlite3_bind_int64(insert_stmt, 1, sqlite3_column_int64(select_stmt, 0));
+            sqlite3_bind_text(insert_stmt, 2, reinterpret_cast<const char *>(sqlite3_column_text(select_stmt, 1)), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_blob(insert_stmt, 3, blob.data(), blob.size(), SQLITE_TRANSIENT);
+            sqlite3_bind_int(insert_stmt, 4, FORMAT_BLOB);
+            ok = sqlite3_step(insert_stmt) == SQLITE_DONE;
+            migrated++;
+        }
+        sqlite3_finalize(select_stmt);
+        sqlite3_finalize(insert_stmt);
+        // 沿用原表自增序号, 避免已删除的编号被复用
+        ok = ok && sqlite3_exec(db, "DELETE FROM sqlite_sequence WHERE name = 'face_migrate';"
+                                    "INSERT INTO sqlite_sequence (name, seq) SELECT 'face_migrate', seq FROM sqlite_sequence WHERE name = 'face';",
+                                0, 0, 0) == SQLITE_OK;
+        ok = ok && sqlite3_exec(db, "DROP TABLE face;", 0, 0, 0) == SQLITE_OK &&
+             sqlite3_exec(db, "ALTER TABLE face_migrate RENAME TO face;", 0, 0, 0) == SQLITE_OK;
+        if (!ok || sqlite3_exec(db, "COMMIT;", 0, 0, 0) != SQLITE_OK)
+        {
+            sqlite3_exec(db, "ROLLBACK;", 0, 0, 0);
+            return false;
+        }
+        cout << "[DB] Migrated " << migrated << " faces" << endl;
+        return true;
     }
 
-    // 获取全部列表
-    std::vector<FaceObject> all_list()
+    // 解析旧版逗号分隔文本特征
+    static bool parseTextDescriptor(const char *text, matrix<float, 0, 1> &face)
     {
-        std::vector<FaceObject> obj_list;
+        face.set_size(FACE_DIM);
+        const char *cursor = text;
+        for (size_t i = 0; i < FACE_DIM; i++)
+        {
+            char *end;
+            face(i) = std::strtof(cursor, &end);
+            if (end == cursor)
+            {
+                return false;
+            }
+            cursor = *end == ',' ? end + 1 : end;
+        }
+        return true;
+    }
 
-        const char *select_sql = "SELECT \"uid\", \"face\" FROM \"face\";";
-        sqlite3_stmt *stmt;
-        int state = sqlite3_prepare_v2(db, select_sql, -1, &stmt, 0);
+    // 分组的索引文件(默认分组沿用配置路径, 其余分组追加十六进制分组名)
+    static std::string indexPath(const std::string &group)
+    {
+        std::string path = FaceConfig::get().ivf_path;
+        if (group.empty())
+        {
+            return path;
+        }
+        static const char *digits = "0123456789abcdef";
+        path += '.';
+        for (unsigned char c : group)
+        {
+            path += digits[c >> 4];
+            path += digits[c & 15];
+        }
+        return path;
+    }
 
-        if (state != SQLITE_OK)
+    /*
+    启用量化编码
+    -----------------
+    各分组扫描压缩编码, 候选用全精度特征重排
+    配置 quant_spill 时全精度特征矩阵映射到数据库所在目录的临时文件, 常驻内存只保留编码
+    */
+    void startQuantization()
+    {
+        const FaceConfig &config = FaceConfig::get();
+        quant_mode = FaceQuant::parseMode(config.quant_mode);
+        if (quant_mode == FaceQuant::NONE)
         {
-            return obj_list;
+            if (config.quant_mode != "none")
+            {
+                cout << "[DB] Unknown quantization mode " << config.quant_mode << ", full precision scan in use" << endl;
+            }
+            return;
         }
+        if (config.quant_spill)
+        {
+            size_t slash = path.rfind('/');
+            FaceSpill::enable(slash == std::string::npos ? "." : path.substr(0, slash));
+            spill_enabled = true;
+        }
+        cout << "[DB] Gallery quantization " << FaceQuant::modeName(quant_mode) << ", kernel " << FaceQuant::kernelName(quant_mode)
+             << ", rerank " << config.quant_rerank << (spill_enabled ? ", full precision rows mapped to file" : "") << endl;
+    }
 
-        // 逐行获取数据
-        while (sqlite3_step(stmt) == SQLITE_ROW)
+    /*
+    启动 IVF 索引
+    -----------------
+    每个分组独立建索引: 优先加载与分组人脸库一致的索引文件, 否则在规模足够时重新训练
+    之后由后台线程定期训练(规模达标时)和落盘(有变更时)
+    */
+    void startIndex()
+    {
+        const FaceConfig &config = FaceConfig::get();
         {
-            FaceObject obj;
-            // 获取标识符
-            obj.uid = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
-            // 获取人脸特征
-            std::string face = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-            dlib::matrix<float, 0, 1> loaded_face_descriptor;
-            std::istringstream iss(face);
-            float value;
-            int num = 0;
-            obj.face.set_size(128);
-            while (iss >> value)
-            {
-                obj.face(num++) = value;
-                if (iss.peek() == ',')
+            std::unique_lock<std::shared_timed_mutex> lock(partition_mutex);
+            index_enabled = true;
+        }
+        for (const auto &item : partitionList())
+        {
+            FaceGallery &gallery = *item.second;
+            std::string path = indexPath(item.first);
+            gallery.enableIndex(config.ivf_lists, config.ivf_probes);
+            if (gallery.loadIndex(path))
+            {
+                cout << "[DB] IVF index loaded from " << path << endl;
+            }
+            else if (gallery.indexNeedsTraining() && gallery.trainIndex())
+            {
+                gallery.saveIndex(path);
+            }
+            else
+            {
+                cout << "[DB] IVF index of group \"" << item.first << "\" waiting for enough faces, exact scan in use" << endl;
+            }
+        }
+        index_worker = std::thread([this]()
+                                   { maintainIndex(); });
+    }
+
+    // 索引维护线程
+    void maintainIndex()
+    {
+        const FaceConfig &config = FaceConfig::get();
+        std::map<const FaceGallery *, uint64_t> saved_changes;
+        for (const auto &item : partitionList())
+        {
+            saved_changes[item.second] = item.second->changeCount();
+        }
+        // 训练并保存有变更的分组索引
+        auto maintain = [&](bool train)
+        {
+            for (const auto &item : partitionList())
+            {
+                FaceGallery &gallery = *item.second;
+                if (train && gallery.indexNeedsTraining())
+                {
+                    gallery.trainIndex();
+                }
+                uint64_t current = gallery.changeCount();
+                auto saved = saved_changes.find(item.second);
+                if ((saved == saved_changes.end() || saved->second != current) && gallery.saveIndex(indexPath(item.first)))
                 {
-                    iss.ignore();
+                    saved_changes[item.second] = current;
                 }
             }
-            // 添加到列表
-            obj_list.push_back(obj);
+        };
+        std::unique_lock<std::mutex> lock(maintain_mutex);
+        while (!maintain_stop)
+        {
+            maintain_cv.wait_for(lock, std::chrono::seconds(std::max<size_t>(1, config.ivf_save_interval)));
+            if (maintain_stop)
+            {
+                break;
+            }
+            // 训练与落盘在锁外进行, 不阻塞快照线程与退出通知
+            lock.unlock();
+            maintain(true);
+            lock.lock();
         }
-        // 完成语句
-        sqlite3_finalize(stmt);
-        return obj_list;
+        lock.unlock();
+        // 退出前保存最新索引
+        maintain(false);
     }
 
-private:
-    std::string matrix_to_string(const dlib::matrix<float, 0, 1> &mat)
+    // 写出快照: 先取已应用序号再拷贝人脸库, 拷贝期间的变更都在该序号之后的日志中, 下次启动时回放修正
+    bool saveSnapshot()
+    {
+        int64_t seq = applied_seq.load();
+        std::vector<FaceSnapshot::Part> parts;
+        size_t rows = 0;
+        for (const auto &item : partitionList())
+        {
+            FaceSnapshot::Part part;
+            part.group = item.first;
+            item.second->exportRows(part.faces, part.uids);
+            rows += part.uids.size();
+            parts.push_back(std::move(part));
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (!FaceSnapshot::save(snapshot_path, parts, seq))
+        {
+            cout << "[DB] Snapshot save failed" << endl;
+            return false;
+        }
+        saved_seq.store(seq);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        cout << "[DB] Snapshot saved, " << rows << " faces up to log SEQ-" << seq << ", " << ms << " ms" << endl;
+        return true;
+    }
+
+    // 快照维护线程(人脸库有变更时重写, 退出前再写一次)
+    void maintainSnapshot()
     {
-        std::ostringstream oss;
-        for (long r = 0; r < mat.nr(); ++r)
+        const FaceConfig &config = FaceConfig::get();
+        // 快照缺失或已落后时首个周期即重写
+        uint64_t saved_changes = snapshot_fresh ? changeCount() : std::numeric_limits<uint64_t>::max();
+        std::unique_lock<std::mutex> lock(maintain_mutex);
+        while (!maintain_stop)
         {
-            for (long c = 0; c < mat.nc(); ++c)
+            maintain_cv.wait_for(lock, std::chrono::seconds(config.snapshot_interval));
+            if (maintain_stop)
             {
-                oss << std::fixed << std::setprecision(8) << mat(r, c);
+                break;
             }
-            if (r < mat.nr() - 1)
+            // 写快照在锁外进行, 不阻塞索引线程与退出通知
+            lock.unlock();
+            uint64_t current = changeCount();
+            if (current != saved_changes && saveSnapshot())
             {
-                oss << ",";
+                saved_changes = current;
             }
+            lock.lock();
+        }
+        lock.unlock();
+        if (changeCount() != saved_changes)
+        {
+            saveSnapshot();
         }
-        return oss.str();
     }
 
 private:
+    std::string path;
+    std::string snapshot_path;
+    bool maintain;
+    // 写连接(建表、迁移与写线程使用)
     sqlite3 *db;
+    sqlite3_stmt *insert_stmt = nullptr;
+    sqlite3_stmt *delete_stmt = nullptr;
+    sqlite3_stmt *log_seq_stmt = nullptr;
+    sqlite3_stmt *prune_stmt = nullptr;
+    // 写线程与待提交队列
+    std::thread writer;
+    std::mutex write_mutex;
+    std::condition_variable write_cv;
+    std::deque<std::unique_ptr<WriteOp>> write_queue;
+    bool write_stop = false;
+    // 空闲读连接
+    std::mutex reader_mutex;
+    std::vector<std::unique_ptr<Reader>> readers;
+    // 各分组的人脸库(分组只增不删, 引用长期有效)
+    mutable std::shared_timed_mutex partition_mutex;
+    std::map<std::string, std::unique_ptr<FaceGallery>> partitions;
+    bool index_enabled = false;
+    FaceQuant::Mode quant_mode = FaceQuant::NONE;
+    bool spill_enabled = false;
+    // 内存库已包含的日志序号前缀(其后只有其他进程的写入未应用)
+    std::atomic<int64_t> applied_seq{0};
+    bool log_gap = false;
+    // 最近一次落盘快照的日志序号, 写线程据此清理日志(只由写线程访问 pruned_seq)
+    bool snapshot_enabled = false;
+    std::atomic<int64_t> saved_seq{0};
+    int64_t pruned_seq = 0;
+    // 启动时快照是否为最新, 以及回放的行数
+    bool snapshot_fresh = false;
+    size_t snapshot_replayed = 0;
+    // 索引与快照维护线程
+    std::thread index_worker;
+    std::thread snapshot_worker;
+    // 只保护退出标志与等待, 维护工作本身不持有
+    std::mutex maintain_mutex;
+    std::condition_variable maintain_cv;
+    bool maintain_stop = false;
 };
\ No newline at end of file
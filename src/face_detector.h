@@ -0,0 +1,255 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-20
+// License: AGPL-3.0
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <dlib/image_processing.h>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <dlib/image_transforms.h>
+
+using namespace dlib;
+using namespace std;
+
+/*
+检测辅助线程池
+--------------------
+全部推理副本共享一组常驻线程, 数量为检测线程数减 1(发起检测的线程自己也参与扫描)
+线程在进程内只创建一次, 检测路径上没有线程创建与回收; 并发请求多时辅助线程忙, 发起线程独自扫描剩余各层
+*/
+class FaceDetectorPool
+{
+public:
+    // 进程内共享的线程池(首次调用时按传入的线程数创建)
+    static FaceDetectorPool &shared(size_t threads)
+    {
+        static FaceDetectorPool pool(threads);
+        return pool;
+    }
+
+    ~FaceDetectorPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wakeup.notify_all();
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    void post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        wakeup.notify_one();
+    }
+
+    size_t size() const
+    {
+        return threads.size();
+    }
+
+private:
+    explicit FaceDetectorPool(size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            threads.emplace_back([this]()
+                                 { run(); });
+        }
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeup.wait(lock, [this]()
+                            { return stop || !tasks.empty(); });
+                if (tasks.empty())
+                {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+    bool stop = false;
+};
+
+/*
+并行多尺度人脸检测
+--------------------
+frontal_face_detector 在单线程上依次扫描图像金字塔的每一层
+配置多个检测线程时, 按与检测器内部相同的规则构建金字塔, 各层交给只扫描单层的检测器副本并行处理,
+候选框换算回原图坐标后按置信度排序, 再用原检测器的重叠判定做非极大值抑制, 结果与单线程扫描一致
+单次检测耗时受最大一层(原尺寸)限制, 适合并发低、对单次延迟敏感的场景
+辅助扫描由共享的 FaceDetectorPool 执行, 不在每次检测时创建线程
+*/
+class FaceDetector
+{
+public:
+    explicit FaceDetector(size_t threads = 1) : detector(get_frontal_face_detector())
+    {
+        if (threads <= 1)
+        {
+            return;
+        }
+        frontal_face_detector::image_scanner_type scanner(detector.get_scanner());
+        scanner.set_max_pyramid_levels(1);
+        std::vector<frontal_face_detector::feature_vector_type> weights;
+        for (unsigned long i = 0; i < detector.num_detectors(); i++)
+        {
+            weights.push_back(detector.get_w(i));
+        }
+        // 单层检测器不做抑制(重叠阈值为 1 时任何框都不算重叠), 候选框汇总后统一处理
+        for (size_t i = 0; i < threads; i++)
+        {
+            level_detectors.emplace_back(scanner, test_box_overlap(1, 1), weights);
+        }
+        pool = &FaceDetectorPool::shared(threads - 1);
+    }
+
+    // 检测人脸, 返回按置信度从高到低排列的人脸框
+    std::vector<rectangle> operator()(const array2d<unsigned char> &img)
+    {
+        if (level_detectors.empty())
+        {
+            return detector(img);
+        }
+        // 与检测器内部相同的层数计算: 逐层缩小到低于最小层尺寸为止
+        const frontal_face_detector::image_scanner_type &scanner = detector.get_scanner();
+        rectangle rect = get_rect(img);
+        size_t count = 0;
+        do
+        {
+            rect = pyr.rect_down(rect);
+            count++;
+        } while (rect.width() >= scanner.get_min_pyramid_layer_width() && rect.height() >= scanner.get_min_pyramid_layer_height() &&
+                 count < scanner.get_max_pyramid_levels());
+        // 第 0 层为原图, 其余层依次缩小(缓冲跨调用复用)
+        if (pyramid.size() < count)
+        {
+            pyramid.resize(count);
+        }
+        for (size_t level = 1; level < count; level++)
+        {
+            pyr(level == 1 ? img : pyramid[level - 1], pyramid[level]);
+        }
+        // 按层从大到小领取, 最大的一层最先开始
+        std::vector<std::vector<rect_detection>> found(count);
+        std::shared_ptr<LevelScan> scan = std::make_shared<LevelScan>();
+        scan->count = count;
+        scan->work = [&](size_t worker, size_t level)
+        {
+            level_detectors[worker](level == 0 ? img : pyramid[level], found[level]);
+            for (rect_detection &candidate : found[level])
+            {
+                candidate.rect = pyr.rect_up(candidate.rect, level);
+            }
+        };
+        // 辅助任务开始得晚时各层可能已被领完, 此时只访问共享状态, 不触及本次调用的局部数据
+        size_t helpers = std::min(std::min(count, level_detectors.size()) - 1, pool->size());
+        for (size_t i = 0; i < helpers; i++)
+        {
+            pool->post([scan]()
+                       { scan->drain(scan->workers++); });
+        }
+        // 当前线程也参与处理, 之后等待辅助线程领走的层完成
+        scan->drain(0);
+        {
+            std::unique_lock<std::mutex> lock(scan->mutex);
+            scan->done.wait(lock, [&scan]()
+                            { return scan->finished == scan->count; });
+        }
+        std::vector<rect_detection> candidates;
+        for (const std::vector<rect_detection> &level : found)
+        {
+            candidates.insert(candidates.end(), level.begin(), level.end());
+        }
+        // 与 object_detector 相同: 置信度从高到低, 与已保留的框重叠则丢弃
+        std::sort(candidates.rbegin(), candidates.rend());
+        test_box_overlap overlaps = detector.get_overlap_tester();
+        std::vector<rectangle> detected;
+        for (const rect_detection &candidate : candidates)
+        {
+            bool suppressed = false;
+            for (const rectangle &kept : detected)
+            {
+                if (overlaps(kept, candidate.rect))
+                {
+                    suppressed = true;
+                    break;
+                }
+            }
+            if (!suppressed)
+            {
+                detected.push_back(candidate.rect);
+            }
+        }
+        return detected;
+    }
+
+    // 并行检测线程数(1 为单线程扫描)
+    size_t threadCount() const
+    {
+        return std::max<size_t>(1, level_detectors.size());
+    }
+
+private:
+    // 一次检测的分层扫描状态, 由发起线程与辅助任务共享
+    struct LevelScan
+    {
+        std::atomic<size_t> next{0};
+        // 检测器副本编号, 0 留给发起线程
+        std::atomic<size_t> workers{1};
+        size_t count = 0;
+        std::function<void(size_t worker, size_t level)> work;
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t finished = 0;
+
+        void drain(size_t worker)
+        {
+            for (size_t level = next++; level < count; level = next++)
+            {
+                work(worker, level);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (++finished == count)
+                {
+                    done.notify_all();
+                }
+            }
+        }
+    };
+
+    // 检测器扫描时会缓存特征金字塔, 不可跨线程共享
+    frontal_face_detector detector;
+    // 每个检测线程一个只扫描单层的副本
+    std::vector<frontal_face_detector> level_detectors;
+    pyramid_down<6> pyr;
+    std::vector<array2d<unsigned char>> pyramid;
+    FaceDetectorPool *pool = nullptr;
+};
@@ -0,0 +1,467 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-05
+// License: AGPL-3.0
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FACE_DISTANCE_X86 1
+#include <immintrin.h>
+#endif
+
+// 人脸特征维度
+const size_t FACE_DIM = 128;
+// 提前放弃检查步长(维度)
+const size_t FACE_ABANDON_STEP = 32;
+
+/*
+大块特征矩阵映射到文件
+--------------------
+启用后, 人脸库的全精度特征矩阵(SpillFloats)不小于 min_bytes 时映射到目录下的临时文件(创建后立即删除, 进程退出即释放)
+文件页由内核按需换入、写回和回收, 不计入常驻匿名内存
+配合量化检索使用: 扫描只读内存中的压缩编码, 全精度特征只在重排时按行访问
+需在人脸库加载前启用; 映射失败时回退到普通堆内存
+*/
+class FaceSpill
+{
+public:
+    static void enable(const std::string &directory, size_t min_bytes = 1 << 20)
+    {
+        settings().directory = directory;
+        settings().min_bytes = min_bytes;
+        settings().enabled = true;
+    }
+
+    static bool enabled(size_t bytes)
+    {
+        return settings().enabled && bytes >= settings().min_bytes;
+    }
+
+    // 映射 length 字节的临时文件, 失败返回 nullptr
+    static void *map(size_t length)
+    {
+        std::string path = settings().directory + "/face.spill.XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+        int fd = ::mkstemp(name.data());
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+        ::unlink(name.data());
+        void *mapped = MAP_FAILED;
+        if (::ftruncate(fd, static_cast<off_t>(length)) == 0)
+        {
+            mapped = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        return mapped == MAP_FAILED ? nullptr : mapped;
+    }
+
+private:
+    struct Settings
+    {
+        bool enabled = false;
+        std::string directory;
+        size_t min_bytes = 0;
+    };
+
+    static Settings &settings()
+    {
+        static Settings value;
+        return value;
+    }
+};
+
+/*
+按缓存行对齐的分配器
+--------------------
+人脸库特征矩阵连续存放, 每行 128 个 float 恰好为 8 个缓存行
+*/
+template <typename T, size_t Align = 64>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef AlignedAllocator<U, Align> other;
+    };
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Align> &) {}
+
+    T *allocate(size_t n)
+    {
+        // 多申请一个对齐块, 在其前方记录原始指针
+        void *raw = ::operator new(n * sizeof(T) + Align + sizeof(void *));
+        uintptr_t base = reinterpret_cast<uintptr_t>(raw) + sizeof(void *);
+        uintptr_t aligned = (base + Align - 1) & ~(uintptr_t)(Align - 1);
+        reinterpret_cast<void **>(aligned)[-1] = raw;
+        return reinterpret_cast<T *>(aligned);
+    }
+
+    void deallocate(T *p, size_t)
+    {
+        ::operator delete(reinterpret_cast<void **>(p)[-1]);
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Align> &) const { return true; }
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Align> &) const { return false; }
+};
+
+/*
+人脸库全精度特征矩阵的分配器
+--------------------
+与 AlignedAllocator 相同的缓存行对齐; 启用 FaceSpill 且块不小于 min_bytes 时映射到文件
+对齐地址前方记录原始指针与映射长度(堆内存为 0)
+只用于人脸库常驻的全精度特征行, 快照、索引与临时拷贝仍使用 AlignedFloats
+*/
+template <typename T, size_t Align = 64>
+struct SpillAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef SpillAllocator<U, Align> other;
+    };
+
+    SpillAllocator() {}
+    template <typename U>
+    SpillAllocator(const SpillAllocator<U, Align> &) {}
+
+    T *allocate(size_t n)
+    {
+        size_t bytes = n * sizeof(T);
+        if (FaceSpill::enabled(bytes))
+        {
+            // 映射起点按页对齐, 首个对齐块用于记录
+            void *raw = FaceSpill::map(bytes + Align);
+            if (raw)
+            {
+                return record(reinterpret_cast<uintptr_t>(raw) + Align, raw, bytes + Align);
+            }
+        }
+        void *raw = ::operator new(bytes + Align + 2 * sizeof(void *));
+        uintptr_t base = reinterpret_cast<uintptr_t>(raw) + 2 * sizeof(void *);
+        return record((base + Align - 1) & ~(uintptr_t)(Align - 1), raw, 0);
+    }
+
+    void deallocate(T *p, size_t)
+    {
+        void *raw = reinterpret_cast<void **>(p)[-1];
+        size_t mapped = reinterpret_cast<size_t *>(p)[-2];
+        if (mapped > 0)
+        {
+            ::munmap(raw, mapped);
+        }
+        else
+        {
+            ::operator delete(raw);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const SpillAllocator<U, Align> &) const { return true; }
+    template <typename U>
+    bool operator!=(const SpillAllocator<U, Align> &) const { return false; }
+
+private:
+    static T *record(uintptr_t aligned, void *raw, size_t mapped)
+    {
+        reinterpret_cast<void **>(aligned)[-1] = raw;
+        reinterpret_cast<size_t *>(aligned)[-2] = mapped;
+        return reinterpret_cast<T *>(aligned);
+    }
+};
+
+typedef std::vector<float, AlignedAllocator<float>> AlignedFloats;
+typedef std::vector<float, SpillAllocator<float>> SpillFloats;
+
+// 匹配结果(行号 + 欧式距离)
+struct FaceHit
+{
+    size_t index;
+    float distance;
+};
+
+/*
+距离核函数
+-----------------
+a, b    两个特征向量
+dim     维度
+bound   平方距离上限, 部分和超过上限即提前放弃并返回部分和
+*/
+typedef float (*FaceDistanceKernel)(const float *a, const float *b, size_t dim, float bound);
+
+class FaceDistance
+{
+public:
+    // 标量实现(兜底)
+    static float l2sqScalar(const float *a, const float *b, size_t dim, float bound)
+    {
+        float sum = 0;
+        size_t i = 0;
+        while (i < dim)
+        {
+            size_t end = std::min(dim, i + FACE_ABANDON_STEP);
+            for (; i < end; i++)
+            {
+                float d = a[i] - b[i];
+                sum += d * d;
+            }
+            if (sum > bound)
+            {
+                return sum;
+            }
+        }
+        return sum;
+    }
+
+#ifdef FACE_DISTANCE_X86
+    // SSE 实现
+    __attribute__((target("sse2"))) static float l2sqSse(const float *a, const float *b, size_t dim, float bound)
+    {
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        size_t i = 0;
+        for (; i + FACE_ABANDON_STEP <= dim;)
+        {
+            for (size_t end = i + FACE_ABANDON_STEP; i < end; i += 8)
+            {
+                __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+                acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+                acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+            }
+            float sum = hsumSse(_mm_add_ps(acc0, acc1));
+            if (sum > bound)
+            {
+                return sum;
+            }
+        }
+        float sum = hsumSse(_mm_add_ps(acc0, acc1));
+        return sum + l2sqScalar(a + i, b + i, dim - i, std::numeric_limits<float>::max());
+    }
+
+    // AVX2 + FMA 实现
+    __attribute__((target("avx2,fma"))) static float l2sqAvx2(const float *a, const float *b, size_t dim, float bound)
+    {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + FACE_ABANDON_STEP <= dim;)
+        {
+            for (size_t end = i + FACE_ABANDON_STEP; i < end; i += 16)
+            {
+                __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+                acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+                acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+            }
+            float sum = hsumAvx2(_mm256_add_ps(acc0, acc1));
+            if (sum > bound)
+            {
+                return sum;
+            }
+        }
+        float sum = hsumAvx2(_mm256_add_ps(acc0, acc1));
+        return sum + l2sqScalar(a + i, b + i, dim - i, std::numeric_limits<float>::max());
+    }
+
+    // AVX-512 实现
+    __attribute__((target("avx512f"))) static float l2sqAvx512(const float *a, const float *b, size_t dim, float bound)
+    {
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        size_t i = 0;
+        for (; i + FACE_ABANDON_STEP <= dim;)
+        {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+            acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+            acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+            i += FACE_ABANDON_STEP;
+            float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+            if (sum > bound)
+            {
+                return sum;
+            }
+        }
+        float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+        return sum + l2sqScalar(a + i, b + i, dim - i, std::numeric_limits<float>::max());
+    }
+#endif
+
+    // 运行时选择当前 CPU 支持的最快实现(只检测一次)
+    static FaceDistanceKernel kernel()
+    {
+        static const FaceDistanceKernel selected = select();
+        return selected;
+    }
+
+    // 当前实现名称
+    static std::string kernelName()
+    {
+        FaceDistanceKernel k = kernel();
+#ifdef FACE_DISTANCE_X86
+        if (k == &l2sqAvx512)
+            return "avx512";
+        if (k == &l2sqAvx2)
+            return "avx2";
+        if (k == &l2sqSse)
+            return "sse";
+#endif
+        return k == &l2sqScalar ? "scalar" : "unknown";
+    }
+
+    // 平方欧式距离
+    static float l2sq(const float *a, const float *b, size_t dim)
+    {
+        return kernel()(a, b, dim, std::numeric_limits<float>::max());
+    }
+
+    /*
+    批量扫描
+    -----------------
+    rows        连续特征矩阵, 行步长为 dim
+    count       行数
+    probes      待匹配特征(每个长度为 dim)
+    threshold   欧式距离阈值
+    k           每个待匹配特征返回的候选数
+    返回每个待匹配特征按距离升序排列的候选
+    */
+    static std::vector<std::vector<FaceHit>> scan(const float *rows, size_t count, size_t dim,
+                                                  const std::vector<const float *> &probes, float threshold, size_t k)
+    {
+        std::vector<std::vector<FaceHit>> heaps(probes.size());
+        // 按平方距离比较, 负阈值(及 NaN)平方后会变成正阈值, 直接视为无匹配
+        if (k == 0 || probes.empty() || !(threshold >= 0))
+        {
+            return heaps;
+        }
+        FaceDistanceKernel fn = kernel();
+        const float limit = threshold * threshold;
+        std::vector<float> bounds(probes.size(), limit);
+        for (auto &heap : heaps)
+        {
+            heap.reserve(k);
+        }
+        // 外层遍历人脸库, 每行只从内存读取一次, 供全部待匹配特征复用
+        for (size_t r = 0; r < count; r++)
+        {
+            const float *row = rows + r * dim;
+            for (size_t p = 0; p < probes.size(); p++)
+            {
+                float distance = fn(row, probes[p], dim, bounds[p]);
+                if (distance > bounds[p])
+                {
+                    continue;
+                }
+                pushHit(heaps[p], FaceHit{r, distance}, k, bounds[p], limit);
+            }
+        }
+        for (auto &heap : heaps)
+        {
+            std::sort_heap(heap.begin(), heap.end(), hitLess);
+            for (FaceHit &hit : heap)
+            {
+                hit.distance = std::sqrt(hit.distance);
+            }
+        }
+        return heaps;
+    }
+
+    // 按距离比较(距离相同时行号小者优先)
+    static bool hitLess(const FaceHit &a, const FaceHit &b)
+    {
+        return a.distance < b.distance || (a.distance == b.distance && a.index < b.index);
+    }
+
+    // 维护大小为 k 的最大堆, 堆满后以堆顶收紧上限
+    static void pushHit(std::vector<FaceHit> &heap, const FaceHit &hit, size_t k, float &bound, float limit)
+    {
+        if (heap.size() < k)
+        {
+            heap.push_back(hit);
+            std::push_heap(heap.begin(), heap.end(), hitLess);
+        }
+        else if (hitLess(hit, heap.front()))
+        {
+            std::pop_heap(heap.begin(), heap.end(), hitLess);
+            heap.back() = hit;
+            std::push_heap(heap.begin(), heap.end(), hitLess);
+        }
+        else
+        {
+            return;
+        }
+        if (heap.size() == k)
+        {
+            // 后续候选必须严格优于堆顶才可能入选
+            bound = std::min(limit, heap.front().distance);
+        }
+    }
+
+private:
+    static FaceDistanceKernel select()
+    {
+#ifdef FACE_DISTANCE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            return &l2sqAvx512;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            return &l2sqAvx2;
+        }
+        if (__builtin_cpu_supports("sse2"))
+        {
+            return &l2sqSse;
+        }
+#endif
+        return &l2sqScalar;
+    }
+
+#ifdef FACE_DISTANCE_X86
+    __attribute__((target("sse2"))) static float hsumSse(__m128 v)
+    {
+        __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+        __m128 sums = _mm_add_ps(v, shuf);
+        shuf = _mm_movehl_ps(shuf, sums);
+        sums = _mm_add_ss(sums, shuf);
+        return _mm_cvtss_f32(sums);
+    }
+
+    __attribute__((target("avx2"))) static float hsumAvx2(__m256 v)
+    {
+        __m128 lo = _mm256_castps256_ps128(v);
+        __m128 hi = _mm256_extractf128_ps(v, 1);
+        lo = _mm_add_ps(lo, hi);
+        __m128 shuf = _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(2, 3, 0, 1));
+        __m128 sums = _mm_add_ps(lo, shuf);
+        shuf = _mm_movehl_ps(shuf, sums);
+        sums = _mm_add_ss(sums, shuf);
+        return _mm_cvtss_f32(sums);
+    }
+#endif
+};
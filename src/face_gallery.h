@@ -0,0 +1,639 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-04
+// License: AGPL-3.0
+#pragma once
+
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <dlib/matrix.h>
+#include "face_distance.h"
+#include "face_index.h"
+#include "face_metrics.h"
+#include "face_quant.h"
+
+using namespace dlib;
+using namespace std;
+
+/*
+常驻内存人脸库
+--------------------
+启动时从数据库加载一次, 之后由 FaceData::save/remove 增量维护
+匹配时只读内存, 不再访问数据库
+特征以 128 维为步长连续存放在对齐内存块中, 由 FaceDistance 批量扫描
+每个 uid 只占一行, uid 到行号的哈希表用于 O(1) 查询与删除
+启用 IVF 索引后, 检索默认走近似索引, 精确扫描用于回退和召回率评估
+启用量化后, 另存一份 int8/fp16 压缩编码供全库扫描, 候选再用全精度特征重排
+*/
+class FaceGallery
+{
+public:
+    struct Entry
+    {
+        std::string uid;
+        matrix<float, 0, 1> face;
+    };
+
+    typedef FaceMatch Match;
+
+    // 召回率评估结果
+    struct Recall
+    {
+        // ivf / int8 / fp16
+        std::string mode;
+        size_t samples;
+        size_t k;
+        size_t nprobe;
+        double recall;
+        double exact_ms;
+        double approx_ms;
+    };
+
+    // 特征内存占用
+    struct Footprint
+    {
+        // 全精度特征矩阵(启用 FaceSpill 时映射到文件)
+        size_t float_bytes;
+        // 量化编码
+        size_t code_bytes;
+    };
+
+    // 全量替换(启动加载)
+    void reset(std::vector<Entry> &&list)
+    {
+        SpillFloats new_faces;
+        std::vector<std::string> new_uids;
+        new_faces.reserve(list.size() * FACE_DIM);
+        new_uids.reserve(list.size());
+        for (Entry &entry : list)
+        {
+            if (entry.face.size() != (long)FACE_DIM)
+            {
+                continue;
+            }
+            new_faces.insert(new_faces.end(), entry.face.begin(), entry.face.end());
+            new_uids.push_back(std::move(entry.uid));
+        }
+        reset(std::move(new_faces), std::move(new_uids));
+    }
+
+    // 全量替换(连续矩阵直接接管, 不再拷贝; 第 i 行对应 uids[i]; uid 重复时保留靠后的一行)
+    void reset(SpillFloats &&new_faces, std::vector<std::string> &&new_uids)
+    {
+        new_faces.resize(new_uids.size() * FACE_DIM);
+        std::unordered_map<std::string, size_t> new_rows;
+        new_rows.reserve(new_uids.size());
+        size_t count = 0;
+        for (size_t i = 0; i < new_uids.size(); i++)
+        {
+            auto found = new_rows.find(new_uids[i]);
+            size_t row = found != new_rows.end() ? found->second : count++;
+            if (row != i)
+            {
+                std::copy(new_faces.begin() + i * FACE_DIM, new_faces.begin() + (i + 1) * FACE_DIM, new_faces.begin() + row * FACE_DIM);
+                new_uids[row] = std::move(new_uids[i]);
+            }
+            new_rows[new_uids[row]] = row;
+        }
+        new_faces.resize(count * FACE_DIM);
+        new_uids.resize(count);
+        uint64_t new_signature = 0;
+        for (size_t i = 0; i < new_uids.size(); i++)
+        {
+            new_signature += FaceIndex::rowHash(new_uids[i], new_faces.data() + i * FACE_DIM);
+        }
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        faces.swap(new_faces);
+        uids.swap(new_uids);
+        rows.swap(new_rows);
+        row_signature = new_signature;
+        if (quant)
+        {
+            encodeAll();
+        }
+        changes++;
+    }
+
+    // 新增人脸(uid 已存在时忽略, 由数据库唯一索引保证不会发生)
+    void add(const std::string &uid, const matrix<float, 0, 1> &face)
+    {
+        if (face.size() != (long)FACE_DIM)
+        {
+            return;
+        }
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        if (!rows.emplace(uid, uids.size()).second)
+        {
+            return;
+        }
+        faces.insert(faces.end(), face.begin(), face.end());
+        uids.push_back(uid);
+        row_signature += FaceIndex::rowHash(uid, face.begin());
+        if (quant)
+        {
+            codes.resize(uids.size() * quant->codeBytes());
+            float error = quant->encode(face.begin(), codes.data() + (uids.size() - 1) * quant->codeBytes());
+            code_error = std::max(code_error, error);
+            // 超出训练范围被截断的行过多时按全库重新统计范围
+            if (error > quant->error() && ++clipped_rows > std::max<size_t>(16, uids.size() / 100))
+            {
+                encodeAll();
+            }
+        }
+        if (index)
+        {
+            index->add(uid, face.begin());
+        }
+        if (index_touched)
+        {
+            index_touched->insert(uid);
+        }
+        changes++;
+    }
+
+    // 删除标识符对应的人脸, 返回删除行数
+    size_t remove(const std::string &uid)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        auto found = rows.find(uid);
+        if (found == rows.end())
+        {
+            return 0;
+        }
+        size_t i = found->second;
+        rows.erase(found);
+        row_signature -= FaceIndex::rowHash(uid, faces.data() + i * FACE_DIM);
+        // 用末行覆盖后截断, 避免整体搬移
+        size_t last = uids.size() - 1;
+        if (i != last)
+        {
+            std::copy(faces.begin() + last * FACE_DIM, faces.begin() + (last + 1) * FACE_DIM, faces.begin() + i * FACE_DIM);
+            uids[i] = std::move(uids[last]);
+            rows[uids[i]] = i;
+            if (quant)
+            {
+                size_t bytes = quant->codeBytes();
+                std::copy(codes.begin() + last * bytes, codes.begin() + (last + 1) * bytes, codes.begin() + i * bytes);
+            }
+        }
+        faces.resize(last * FACE_DIM);
+        uids.pop_back();
+        if (quant)
+        {
+            codes.resize(last * quant->codeBytes());
+        }
+        if (index)
+        {
+            index->remove(uid);
+        }
+        if (index_touched)
+        {
+            index_touched->insert(uid);
+            if (i != last)
+            {
+                index_touched->insert(uids[i]);
+            }
+        }
+        changes++;
+        return 1;
+    }
+
+    // 拷贝全部行(写快照用)
+    void exportRows(SpillFloats &out_faces, std::vector<std::string> &out_uids) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        out_faces.assign(faces.begin(), faces.end());
+        out_uids = uids;
+    }
+
+    // uid 是否已入库
+    bool contains(const std::string &uid) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return rows.count(uid) > 0;
+    }
+
+    size_t size() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return uids.size();
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    Footprint footprint() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return Footprint{faces.capacity() * sizeof(float), codes.capacity()};
+    }
+
+    // 查找阈值内距离最小的标识符, 无匹配返回空字符串
+    std::string match(const matrix<float, 0, 1> &face, float threshold) const
+    {
+        std::vector<std::vector<Match>> result = search(std::vector<matrix<float, 0, 1>>{face}, threshold, 1);
+        return result[0].empty() ? "" : result[0][0].uid;
+    }
+
+    /*
+    为多个特征查找阈值内距离最小的 k 个候选
+    -----------------
+    启用且已训练 IVF 索引时走近似检索(nprobe 为 0 使用默认值)
+    否则一次扫描全库(启用量化时扫描压缩编码并重排)
+    */
+    std::vector<std::vector<Match>> search(const std::vector<matrix<float, 0, 1>> &probes, float threshold, size_t k, size_t nprobe = 0) const
+    {
+        std::vector<std::vector<Match>> result(probes.size());
+        std::vector<const float *> probe_ptrs;
+        std::vector<size_t> probe_slots;
+        collectProbes(probes, probe_ptrs, probe_slots);
+        FaceTimer timer(FaceMetrics::SEARCH);
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        std::vector<std::vector<Match>> found = approximate() ? index->search(probe_ptrs, threshold, k, nprobe)
+                                                : quant       ? scanQuantized(probe_ptrs, threshold, k)
+                                                              : scanExact(probe_ptrs, threshold, k);
+        for (size_t p = 0; p < found.size(); p++)
+        {
+            result[probe_slots[p]] = std::move(found[p]);
+        }
+        return result;
+    }
+
+    // 精确扫描全库(全精度特征)
+    std::vector<std::vector<Match>> searchExact(const std::vector<matrix<float, 0, 1>> &probes, float threshold, size_t k) const
+    {
+        std::vector<std::vector<Match>> result(probes.size());
+        std::vector<const float *> probe_ptrs;
+        std::vector<size_t> probe_slots;
+        collectProbes(probes, probe_ptrs, probe_slots);
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        std::vector<std::vector<Match>> found = scanExact(probe_ptrs, threshold, k);
+        for (size_t p = 0; p < found.size(); p++)
+        {
+            result[probe_slots[p]] = std::move(found[p]);
+        }
+        return result;
+    }
+
+    /*
+    启用量化编码
+    -----------------
+    按当前人脸库统计逐维范围并编码全部行, 之后的新增行沿用该范围(超出部分截断)
+    rerank 为重排候选数下限, 实际为 max(k * 4, rerank)
+    */
+    void enableQuantization(FaceQuant::Mode mode, size_t rerank)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        if (mode == FaceQuant::NONE)
+        {
+            quant.reset();
+            AlignedBytes().swap(codes);
+            return;
+        }
+        quant.reset(new FaceQuant(mode));
+        rerank_count = std::max<size_t>(1, rerank);
+        encodeAll();
+    }
+
+    FaceQuant::Mode quantMode() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return quant ? quant->mode() : FaceQuant::NONE;
+    }
+
+    // 启用 IVF 索引(未训练前检索仍走精确扫描)
+    void enableIndex(size_t lists, size_t probes)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        index.reset(new FaceIndex(lists, probes));
+    }
+
+    bool indexEnabled() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return index != nullptr;
+    }
+
+    bool indexTrained() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return approximate();
+    }
+
+    // 人脸库规模已满足训练要求但索引尚未训练
+    bool indexNeedsTraining() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return index && !index->trained() && uids.size() >= index->minTrainSize();
+    }
+
+    // 变更计数, 用于判断索引是否需要重新落盘
+    uint64_t changeCount() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return changes;
+    }
+
+    /*
+    训练 IVF 索引
+    -----------------
+    抽样与 k-means 在锁外进行; 全库归类写入新的索引对象, 每次只在读锁内拷贝一小块行, 归类在锁外进行
+    归类期间新增、删除与被搬移的 uid 记入待补列表, 最后在写锁内按当前行补齐后换入新索引
+    */
+    bool trainIndex()
+    {
+        std::lock_guard<std::mutex> train_lock(train_mutex);
+        size_t lists;
+        size_t probes;
+        AlignedFloats samples;
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(mutex);
+            if (!index || uids.empty())
+            {
+                return false;
+            }
+            lists = index->lists();
+            probes = index->probes();
+            size_t count = uids.size();
+            size_t sample_count = std::min(count, lists * 64);
+            std::vector<size_t> order(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                order[i] = i;
+            }
+            std::mt19937 rng(static_cast<uint32_t>(count));
+            std::shuffle(order.begin(), order.end(), rng);
+            samples.reserve(sample_count * FACE_DIM);
+            for (size_t i = 0; i < sample_count; i++)
+            {
+                samples.insert(samples.end(), faces.begin() + order[i] * FACE_DIM, faces.begin() + (order[i] + 1) * FACE_DIM);
+            }
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<FaceIndex> built(new FaceIndex(lists, probes));
+        built->reset(FaceIndex::trainCentroids(samples.data(), samples.size() / FACE_DIM, lists));
+        std::unordered_set<std::string> touched;
+        AlignedFloats block;
+        std::vector<std::string> block_uids;
+        for (size_t offset = 0;; offset += INDEX_BUILD_BLOCK)
+        {
+            {
+                std::shared_lock<std::shared_timed_mutex> lock(mutex);
+                if (offset == 0)
+                {
+                    // 读锁排除了写入, 写入方只在写锁内访问待补列表
+                    index_touched = &touched;
+                }
+                if (offset >= uids.size())
+                {
+                    break;
+                }
+                size_t end = std::min(uids.size(), offset + INDEX_BUILD_BLOCK);
+                block.assign(faces.begin() + offset * FACE_DIM, faces.begin() + end * FACE_DIM);
+                block_uids.assign(uids.begin() + offset, uids.begin() + end);
+            }
+            built->addBatch(block.data(), block_uids.data(), block_uids.size());
+        }
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        index_touched = nullptr;
+        if (!index)
+        {
+            return false;
+        }
+        // 分块期间行号可能变化(删除时末行搬移), 涉及的 uid 先删后按当前行补入
+        for (const std::string &uid : touched)
+        {
+            built->remove(uid);
+            auto found = rows.find(uid);
+            if (found != rows.end())
+            {
+                built->add(uid, faces.data() + found->second * FACE_DIM);
+            }
+        }
+        index.swap(built);
+        size_t indexed = index->size();
+        changes++;
+        lock.unlock();
+        auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        cout << "[GA] IVF index trained, " << lists << " lists, " << indexed << " faces, " << touched.size() << " patched, " << cost << " ms" << endl;
+        return true;
+    }
+
+    // 从文件加载 IVF 索引, 与人脸库不一致时返回 false
+    bool loadIndex(const std::string &path)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(mutex);
+        if (!index)
+        {
+            return false;
+        }
+        FaceIndex loaded(index->lists(), index->probes());
+        if (!loaded.load(path, uids.size(), row_signature))
+        {
+            return false;
+        }
+        *index = std::move(loaded);
+        return true;
+    }
+
+    // 将 IVF 索引写入文件
+    bool saveIndex(const std::string &path) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return approximate() && index->save(path);
+    }
+
+    /*
+    评估近似检索召回率
+    -----------------
+    从人脸库随机抽取 samples 个特征作为待匹配特征
+    以精确扫描的前 k 个候选为基准, 统计近似检索(IVF 索引, 未训练时为量化扫描加重排)命中的比例
+    */
+    Recall measureRecall(size_t samples, size_t k, float threshold, size_t nprobe) const
+    {
+        Recall report{"", 0, k, nprobe, 0, 0, 0};
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        if ((!approximate() && !quant) || uids.empty() || k == 0)
+        {
+            return report;
+        }
+        if (approximate())
+        {
+            report.mode = "ivf";
+            report.nprobe = std::min(nprobe == 0 ? index->probes() : nprobe, index->lists());
+        }
+        else
+        {
+            report.mode = FaceQuant::modeName(quant->mode());
+            report.nprobe = 0;
+        }
+        std::mt19937 rng(static_cast<uint32_t>(std::chrono::steady_clock::now().time_since_epoch().count()));
+        std::uniform_int_distribution<size_t> pick(0, uids.size() - 1);
+        // 库内原始行作为查询总能在自身所在的簇/编码中命中自己, 会高估召回率;
+        // 给每个抽样行叠加噪声模拟同一人的另一张照片(每维 0.02, 整体距离约 0.23, 低于常用阈值 0.6)
+        std::normal_distribution<float> noise(0.0f, 0.02f);
+        AlignedFloats probes(samples * FACE_DIM);
+        std::vector<const float *> probe_ptrs;
+        for (size_t i = 0; i < samples; i++)
+        {
+            const float *row = faces.data() + pick(rng) * FACE_DIM;
+            float *probe = probes.data() + i * FACE_DIM;
+            for (size_t d = 0; d < FACE_DIM; d++)
+            {
+                probe[d] = row[d] + noise(rng);
+            }
+            probe_ptrs.push_back(probe);
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::vector<Match>> exact = scanExact(probe_ptrs, threshold, k);
+        auto middle = std::chrono::steady_clock::now();
+        std::vector<std::vector<Match>> approx = approximate() ? index->search(probe_ptrs, threshold, k, nprobe)
+                                                               : scanQuantized(probe_ptrs, threshold, k);
+        auto end = std::chrono::steady_clock::now();
+        size_t expected = 0;
+        size_t found = 0;
+        for (size_t p = 0; p < probe_ptrs.size(); p++)
+        {
+            for (const Match &truth : exact[p])
+            {
+                expected++;
+                for (const Match &hit : approx[p])
+                {
+                    if (hit.uid == truth.uid)
+                    {
+                        found++;
+                        break;
+                    }
+                }
+            }
+        }
+        report.samples = probe_ptrs.size();
+        report.recall = expected == 0 ? 1.0 : static_cast<double>(found) / expected;
+        report.exact_ms = std::chrono::duration<double, std::milli>(middle - start).count();
+        report.approx_ms = std::chrono::duration<double, std::milli>(end - middle).count();
+        return report;
+    }
+
+private:
+    bool approximate() const
+    {
+        return index && index->trained();
+    }
+
+    static void collectProbes(const std::vector<matrix<float, 0, 1>> &probes, std::vector<const float *> &probe_ptrs, std::vector<size_t> &probe_slots)
+    {
+        for (size_t i = 0; i < probes.size(); i++)
+        {
+            if (probes[i].size() == (long)FACE_DIM)
+            {
+                probe_ptrs.push_back(probes[i].begin());
+                probe_slots.push_back(i);
+            }
+        }
+    }
+
+    std::vector<std::vector<Match>> scanExact(const std::vector<const float *> &probe_ptrs, float threshold, size_t k) const
+    {
+        std::vector<std::vector<FaceHit>> hits = FaceDistance::scan(faces.data(), uids.size(), FACE_DIM, probe_ptrs, threshold, k);
+        std::vector<std::vector<Match>> result(hits.size());
+        for (size_t p = 0; p < hits.size(); p++)
+        {
+            for (const FaceHit &hit : hits[p])
+            {
+                result[p].push_back(Match{uids[hit.index], hit.distance});
+            }
+        }
+        return result;
+    }
+
+    /*
+    量化扫描后重排
+    -----------------
+    按 阈值 + 全库最大编码误差(含截断行) 扫描压缩编码取前 max(k * 4, rerank) 个候选,
+    再用全精度特征计算真实距离, 过滤阈值并取前 k 个
+    真实距离在阈值内的行不会被放宽后的阈值过滤掉, 召回损失只来自候选数截断
+    */
+    std::vector<std::vector<Match>> scanQuantized(const std::vector<const float *> &probe_ptrs, float threshold, size_t k) const
+    {
+        if (!(threshold >= 0))
+        {
+            return std::vector<std::vector<Match>>(probe_ptrs.size());
+        }
+        size_t candidates = std::max(k * 4, rerank_count);
+        std::vector<std::vector<FaceHit>> hits = quant->scan(codes.data(), uids.size(), probe_ptrs, threshold + code_error, candidates);
+        std::vector<std::vector<Match>> result(hits.size());
+        const float limit = threshold * threshold;
+        for (size_t p = 0; p < hits.size(); p++)
+        {
+            std::vector<FaceHit> heap;
+            heap.reserve(k);
+            float bound = limit;
+            for (const FaceHit &hit : hits[p])
+            {
+                float distance = FaceDistance::kernel()(faces.data() + hit.index * FACE_DIM, probe_ptrs[p], FACE_DIM, bound);
+                if (distance <= bound)
+                {
+                    FaceDistance::pushHit(heap, FaceHit{hit.index, distance}, k, bound, limit);
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end(), FaceDistance::hitLess);
+            for (const FaceHit &hit : heap)
+            {
+                result[p].push_back(Match{uids[hit.index], std::sqrt(hit.distance)});
+            }
+        }
+        return result;
+    }
+
+    // 按当前人脸库重新统计范围并编码全部行(调用方持有写锁)
+    void encodeAll()
+    {
+        size_t count = uids.size();
+        quant->train(faces.data(), count);
+        size_t bytes = quant->codeBytes();
+        AlignedBytes new_codes(count * bytes);
+        code_error = quant->error();
+        for (size_t i = 0; i < count; i++)
+        {
+            code_error = std::max(code_error, quant->encode(faces.data() + i * FACE_DIM, new_codes.data() + i * bytes));
+        }
+        codes.swap(new_codes);
+        clipped_rows = 0;
+    }
+
+private:
+    // 训练索引时每次在读锁内拷贝的行数
+    static const size_t INDEX_BUILD_BLOCK = 4096;
+
+    mutable std::shared_timed_mutex mutex;
+    // 连续特征矩阵, 第 i 行为 faces[i * FACE_DIM, (i + 1) * FACE_DIM)
+    SpillFloats faces;
+    std::vector<std::string> uids;
+    // uid 到行号
+    std::unordered_map<std::string, size_t> rows;
+    uint64_t row_signature = 0;
+    uint64_t changes = 0;
+    // 可选 IVF 近似索引
+    std::unique_ptr<FaceIndex> index;
+    // 可选量化编码, 第 i 行为 codes[i * codeBytes(), (i + 1) * codeBytes())
+    std::unique_ptr<FaceQuant> quant;
+    AlignedBytes codes;
+    size_t rerank_count = 32;
+    // 已编码行的最大编码误差(删除行后不回退, 保守)
+    float code_error = 0;
+    // 上次统计范围后被截断的新增行数
+    size_t clipped_rows = 0;
+    // 同一时刻只训练一次索引; 训练期间记录需补入新索引的 uid(写锁内访问)
+    std::mutex train_mutex;
+    std::unordered_set<std::string> *index_touched = nullptr;
+};
@@ -0,0 +1,158 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-08
+// License: AGPL-3.0
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <dlib/image_io.h>
+#include "face_config.h"
+
+using namespace dlib;
+using namespace std;
+
+/*
+内存图像解码
+--------------------
+直接从上传内容解码 JPEG/PNG, 不经过临时文件
+解码前先读取文件头中的尺寸, 超限图片不做完整解码
+*/
+class FaceImage
+{
+public:
+    enum Format
+    {
+        UNKNOWN,
+        JPEG,
+        PNG
+    };
+
+    struct Info
+    {
+        Format format;
+        long width;
+        long height;
+    };
+
+    // 仅解析文件头获取格式与尺寸
+    static bool probe(const std::string &data, Info &info)
+    {
+        info = Info{UNKNOWN, 0, 0};
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data.data());
+        size_t size = data.size();
+        if (size >= 24 && std::string(data, 0, 8) == "\x89PNG\r\n\x1a\n" && std::string(data, 12, 4) == "IHDR")
+        {
+            info.format = PNG;
+            info.width = readBigEndian32(bytes + 16);
+            info.height = readBigEndian32(bytes + 20);
+            return info.width > 0 && info.height > 0;
+        }
+        if (size >= 4 && bytes[0] == 0xFF && bytes[1] == 0xD8)
+        {
+            info.format = JPEG;
+            return probeJpeg(bytes, size, info);
+        }
+        return false;
+    }
+
+    // 检查图片是否可处理, 不可处理时返回原因
+    static bool check(const std::string &data, std::string &reason)
+    {
+        Info info;
+        if (!probe(data, info))
+        {
+            reason = "图片格式不支持";
+            return false;
+        }
+        if (static_cast<uint64_t>(info.width) * info.height > FaceConfig::get().max_image_pixels)
+        {
+            reason = "图片尺寸过大";
+            return false;
+        }
+        return true;
+    }
+
+    // 从内存解码图像, 格式不支持或尺寸超限时返回 false
+    template <typename image_type>
+    static bool decode(const std::string &data, image_type &img)
+    {
+        std::string reason;
+        if (!check(data, reason))
+        {
+            return false;
+        }
+        Info info;
+        probe(data, info);
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data.data());
+        if (info.format == JPEG)
+        {
+            load_jpeg(img, bytes, data.size());
+        }
+        else
+        {
+            load_png(img, bytes, data.size());
+        }
+        return img.size() > 0;
+    }
+
+private:
+    static long readBigEndian16(const unsigned char *p)
+    {
+        return (static_cast<long>(p[0]) << 8) | p[1];
+    }
+
+    static long readBigEndian32(const unsigned char *p)
+    {
+        return static_cast<long>((static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+                                 (static_cast<uint32_t>(p[2]) << 8) | p[3]);
+    }
+
+    // 逐段跳过 JPEG 标记, 直到帧头(SOFn)读出宽高
+    static bool probeJpeg(const unsigned char *bytes, size_t size, Info &info)
+    {
+        size_t pos = 2;
+        while (pos + 4 <= size)
+        {
+            if (bytes[pos] != 0xFF)
+            {
+                return false;
+            }
+            unsigned char marker = bytes[pos + 1];
+            // 填充字节
+            if (marker == 0xFF)
+            {
+                pos++;
+                continue;
+            }
+            // 无长度字段的独立标记
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+            {
+                pos += 2;
+                continue;
+            }
+            long length = readBigEndian16(bytes + pos + 2);
+            if (length < 2)
+            {
+                return false;
+            }
+            // SOF0-SOF15, 排除 DHT(C4) JPG(C8) DAC(CC)
+            if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+            {
+                if (pos + 9 > size)
+                {
+                    return false;
+                }
+                info.height = readBigEndian16(bytes + pos + 5);
+                info.width = readBigEndian16(bytes + pos + 7);
+                return info.width > 0 && info.height > 0;
+            }
+            // 扫描开始或图像结束前仍未找到帧头
+            if (marker == 0xDA || marker == 0xD9)
+            {
+                return false;
+            }
+            pos += 2 + length;
+        }
+        return false;
+    }
+};
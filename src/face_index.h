@@ -0,0 +1,466 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-06
+// License: AGPL-3.0
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "face_distance.h"
+
+using namespace std;
+
+// 匹配候选
+struct FaceMatch
+{
+    std::string uid;
+    float distance;
+};
+
+/*
+IVF-Flat 近似检索索引
+--------------------
+训练: 对人脸库抽样做 k-means 得到 lists 个聚类中心
+入库: 特征归入最近的中心所在倒排列表, 每个列表内连续存放
+检索: 只扫描离待匹配特征最近的 probes 个列表
+本类不加锁, 由 FaceGallery 在其读写锁内调用
+*/
+class FaceIndex
+{
+public:
+    FaceIndex(size_t lists, size_t probes) : list_count(std::max<size_t>(1, lists)), default_probes(std::max<size_t>(1, probes)) {}
+
+    // 训练所需的最少样本数
+    size_t minTrainSize() const
+    {
+        return list_count * 39;
+    }
+
+    bool trained() const
+    {
+        return !centroids.empty();
+    }
+
+    size_t size() const
+    {
+        return rows;
+    }
+
+    size_t lists() const
+    {
+        return list_count;
+    }
+
+    size_t probes() const
+    {
+        return default_probes;
+    }
+
+    // 与人脸库内容对应的签名(各行哈希之和, 与顺序无关)
+    uint64_t signature() const
+    {
+        return row_signature;
+    }
+
+    // 单行哈希(FNV-1a, 覆盖标识符与特征)
+    static uint64_t rowHash(const std::string &uid, const float *face)
+    {
+        uint64_t hash = 1469598103934665603ULL;
+        for (unsigned char c : uid)
+        {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(face);
+        for (size_t i = 0; i < FACE_DIM * sizeof(float); i++)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // 对样本做 k-means 训练聚类中心(不修改索引, 可在锁外执行)
+    static AlignedFloats trainCentroids(const float *samples, size_t count, size_t lists, size_t iterations = 10)
+    {
+        AlignedFloats centers;
+        if (count == 0)
+        {
+            return centers;
+        }
+        lists = std::min(lists, count);
+        std::mt19937 rng(20231206);
+        // 随机选取初始中心
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            order[i] = i;
+        }
+        std::shuffle(order.begin(), order.end(), rng);
+        centers.resize(lists * FACE_DIM);
+        for (size_t c = 0; c < lists; c++)
+        {
+            std::copy(samples + order[c] * FACE_DIM, samples + (order[c] + 1) * FACE_DIM, centers.begin() + c * FACE_DIM);
+        }
+        std::vector<uint32_t> assign(count);
+        std::vector<double> sums(lists * FACE_DIM);
+        std::vector<size_t> counts(lists);
+        for (size_t it = 0; it < iterations; it++)
+        {
+            assignNearest(centers.data(), lists, samples, count, assign);
+            std::fill(sums.begin(), sums.end(), 0.0);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < count; i++)
+            {
+                const float *v = samples + i * FACE_DIM;
+                double *sum = sums.data() + assign[i] * FACE_DIM;
+                for (size_t d = 0; d < FACE_DIM; d++)
+                {
+                    sum[d] += v[d];
+                }
+                counts[assign[i]]++;
+            }
+            std::uniform_int_distribution<size_t> pick(0, count - 1);
+            for (size_t c = 0; c < lists; c++)
+            {
+                float *center = centers.data() + c * FACE_DIM;
+                if (counts[c] == 0)
+                {
+                    // 空簇用随机样本重新播种
+                    const float *v = samples + pick(rng) * FACE_DIM;
+                    std::copy(v, v + FACE_DIM, center);
+                    continue;
+                }
+                for (size_t d = 0; d < FACE_DIM; d++)
+                {
+                    center[d] = static_cast<float>(sums[c * FACE_DIM + d] / counts[c]);
+                }
+            }
+        }
+        return centers;
+    }
+
+    // 换用已训练的中心并清空倒排列表, 之后由 addBatch 分批归类
+    void reset(AlignedFloats &&centers)
+    {
+        centroids = std::move(centers);
+        list_count = centroids.size() / FACE_DIM;
+        clear();
+    }
+
+    // 批量归类入库(未训练时忽略)
+    void addBatch(const float *faces, const std::string *uids, size_t count)
+    {
+        if (!trained())
+        {
+            return;
+        }
+        std::vector<uint32_t> assign;
+        assignNearest(centroids.data(), list_count, faces, count, assign);
+        for (size_t i = 0; i < count; i++)
+        {
+            append(assign[i], uids[i], faces + i * FACE_DIM);
+        }
+    }
+
+    // 新增人脸(未训练时忽略)
+    void add(const std::string &uid, const float *face)
+    {
+        if (!trained())
+        {
+            return;
+        }
+        append(nearestList(face), uid, face);
+    }
+
+    // 删除标识符对应的全部人脸
+    size_t remove(const std::string &uid)
+    {
+        auto it = uid_lists.find(uid);
+        if (it == uid_lists.end())
+        {
+            return 0;
+        }
+        size_t removed = 0;
+        for (uint32_t l : it->second)
+        {
+            List &list = inverted[l];
+            for (size_t i = 0; i < list.uids.size();)
+            {
+                if (list.uids[i] != uid)
+                {
+                    i++;
+                    continue;
+                }
+                row_signature -= rowHash(uid, list.faces.data() + i * FACE_DIM);
+                size_t last = list.uids.size() - 1;
+                if (i != last)
+                {
+                    std::copy(list.faces.begin() + last * FACE_DIM, list.faces.begin() + (last + 1) * FACE_DIM, list.faces.begin() + i * FACE_DIM);
+                    list.uids[i] = std::move(list.uids[last]);
+                }
+                list.faces.resize(last * FACE_DIM);
+                list.uids.pop_back();
+                removed++;
+            }
+        }
+        uid_lists.erase(it);
+        rows -= removed;
+        return removed;
+    }
+
+    /*
+    近似检索
+    -----------------
+    probes      待匹配特征
+    threshold   欧式距离阈值
+    k           每个待匹配特征返回的候选数
+    nprobe      扫描的倒排列表数, 为 0 时使用默认值
+    */
+    std::vector<std::vector<FaceMatch>> search(const std::vector<const float *> &probes, float threshold, size_t k, size_t nprobe) const
+    {
+        std::vector<std::vector<FaceMatch>> result(probes.size());
+        if (!trained() || k == 0)
+        {
+            return result;
+        }
+        nprobe = std::min(nprobe == 0 ? default_probes : nprobe, list_count);
+        // 找出每个待匹配特征最近的 nprobe 个列表
+        std::vector<std::vector<FaceHit>> near = FaceDistance::scan(centroids.data(), list_count, FACE_DIM, probes,
+                                                                     std::numeric_limits<float>::infinity(), nprobe);
+        for (size_t p = 0; p < probes.size(); p++)
+        {
+            std::vector<FaceHit> merged;
+            std::vector<const std::string *> merged_uids;
+            for (const FaceHit &center : near[p])
+            {
+                const List &list = inverted[center.index];
+                if (list.uids.empty())
+                {
+                    continue;
+                }
+                std::vector<std::vector<FaceHit>> hits = FaceDistance::scan(list.faces.data(), list.uids.size(), FACE_DIM,
+                                                                            std::vector<const float *>{probes[p]}, threshold, k);
+                for (const FaceHit &hit : hits[0])
+                {
+                    merged.push_back(FaceHit{merged_uids.size(), hit.distance});
+                    merged_uids.push_back(&list.uids[hit.index]);
+                }
+            }
+            size_t take = std::min(k, merged.size());
+            std::partial_sort(merged.begin(), merged.begin() + take, merged.end(), FaceDistance::hitLess);
+            for (size_t i = 0; i < take; i++)
+            {
+                result[p].push_back(FaceMatch{*merged_uids[merged[i].index], merged[i].distance});
+            }
+        }
+        return result;
+    }
+
+    // 写入索引文件(先写临时文件再改名, 避免半截文件)
+    bool save(const std::string &path) const
+    {
+        std::string temp_path = path + ".tmp";
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            return false;
+        }
+        out.write(fileMagic(), 4);
+        writeValue<uint32_t>(out, FILE_VERSION);
+        writeValue<uint32_t>(out, FACE_DIM);
+        writeValue<uint64_t>(out, list_count);
+        writeValue<uint64_t>(out, rows);
+        writeValue<uint64_t>(out, row_signature);
+        out.write(reinterpret_cast<const char *>(centroids.data()), centroids.size() * sizeof(float));
+        for (const List &list : inverted)
+        {
+            writeValue<uint64_t>(out, list.uids.size());
+            for (const std::string &uid : list.uids)
+            {
+                writeValue<uint32_t>(out, uid.size());
+                out.write(uid.data(), uid.size());
+            }
+            out.write(reinterpret_cast<const char *>(list.faces.data()), list.faces.size() * sizeof(float));
+        }
+        out.close();
+        if (!out)
+        {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return std::rename(temp_path.c_str(), path.c_str()) == 0;
+    }
+
+    // 读取索引文件, 行数或签名与人脸库不一致、文件截断或损坏时返回 false(由调用方重新训练)
+    bool load(const std::string &path, size_t expect_rows, uint64_t expect_signature)
+    {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+        {
+            return false;
+        }
+        // 文件中声明的长度与数量都不能超过剩余字节数, 避免损坏的文件触发超大分配或越界读取
+        const uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        in.seekg(0);
+        auto remaining = [&in, file_size]()
+        {
+            std::streamoff position = in.tellg();
+            return position < 0 ? 0 : file_size - static_cast<uint64_t>(position);
+        };
+        char magic[4];
+        in.read(magic, 4);
+        if (!in || std::string(magic, 4) != fileMagic() || readValue<uint32_t>(in) != FILE_VERSION || readValue<uint32_t>(in) != FACE_DIM)
+        {
+            return false;
+        }
+        uint64_t file_lists = readValue<uint64_t>(in);
+        uint64_t file_rows = readValue<uint64_t>(in);
+        uint64_t file_signature = readValue<uint64_t>(in);
+        if (!in || file_lists == 0 || file_rows != expect_rows || file_signature != expect_signature ||
+            file_lists > remaining() / (FACE_DIM * sizeof(float)))
+        {
+            return false;
+        }
+        AlignedFloats centers(file_lists * FACE_DIM);
+        in.read(reinterpret_cast<char *>(centers.data()), centers.size() * sizeof(float));
+        std::vector<List> lists(file_lists);
+        std::unordered_map<std::string, std::vector<uint32_t>> owners;
+        size_t total = 0;
+        for (uint32_t l = 0; l < file_lists && in; l++)
+        {
+            uint64_t count = readValue<uint64_t>(in);
+            // 每行至少有 uid 长度与特征
+            if (!in || count > file_rows || count > remaining() / (sizeof(uint32_t) + FACE_DIM * sizeof(float)))
+            {
+                return false;
+            }
+            lists[l].uids.resize(count);
+            for (std::string &uid : lists[l].uids)
+            {
+                uint32_t length = readValue<uint32_t>(in);
+                if (!in || length > MAX_UID_BYTES || length > remaining())
+                {
+                    return false;
+                }
+                uid.resize(length);
+                in.read(&uid[0], uid.size());
+                std::vector<uint32_t> &owned = owners[uid];
+                if (owned.empty() || owned.back() != l)
+                {
+                    owned.push_back(l);
+                }
+            }
+            lists[l].faces.resize(count * FACE_DIM);
+            in.read(reinterpret_cast<char *>(lists[l].faces.data()), lists[l].faces.size() * sizeof(float));
+            total += count;
+        }
+        if (!in || total != file_rows)
+        {
+            return false;
+        }
+        centroids = std::move(centers);
+        list_count = file_lists;
+        inverted = std::move(lists);
+        uid_lists = std::move(owners);
+        rows = total;
+        row_signature = file_signature;
+        return true;
+    }
+
+private:
+    struct List
+    {
+        AlignedFloats faces;
+        std::vector<std::string> uids;
+    };
+
+    void clear()
+    {
+        inverted.assign(list_count, List());
+        uid_lists.clear();
+        rows = 0;
+        row_signature = 0;
+    }
+
+    void append(uint32_t l, const std::string &uid, const float *face)
+    {
+        List &list = inverted[l];
+        list.faces.insert(list.faces.end(), face, face + FACE_DIM);
+        list.uids.push_back(uid);
+        std::vector<uint32_t> &owned = uid_lists[uid];
+        if (std::find(owned.begin(), owned.end(), l) == owned.end())
+        {
+            owned.push_back(l);
+        }
+        rows++;
+        row_signature += rowHash(uid, face);
+    }
+
+    uint32_t nearestList(const float *face) const
+    {
+        std::vector<uint32_t> assign;
+        assignNearest(centroids.data(), list_count, face, 1, assign);
+        return assign[0];
+    }
+
+    // 为每个向量找到最近的中心, 分块调用批量扫描以保持待匹配特征在缓存中
+    static void assignNearest(const float *centers, size_t lists, const float *vectors, size_t count, std::vector<uint32_t> &assign)
+    {
+        const size_t block = 64;
+        assign.resize(count);
+        std::vector<const float *> probes;
+        for (size_t start = 0; start < count; start += block)
+        {
+            size_t end = std::min(count, start + block);
+            probes.clear();
+            for (size_t i = start; i < end; i++)
+            {
+                probes.push_back(vectors + i * FACE_DIM);
+            }
+            std::vector<std::vector<FaceHit>> hits = FaceDistance::scan(centers, lists, FACE_DIM, probes, std::numeric_limits<float>::infinity(), 1);
+            for (size_t i = start; i < end; i++)
+            {
+                assign[i] = hits[i - start].empty() ? 0 : static_cast<uint32_t>(hits[i - start][0].index);
+            }
+        }
+    }
+
+    template <typename T>
+    static void writeValue(std::ofstream &out, T value)
+    {
+        out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static T readValue(std::ifstream &in)
+    {
+        T value = 0;
+        in.read(reinterpret_cast<char *>(&value), sizeof(T));
+        return value;
+    }
+
+    static const char *fileMagic()
+    {
+        return "FIVF";
+    }
+
+    static const uint32_t FILE_VERSION = 1;
+    // 索引文件中 uid 的最大长度
+    static const uint32_t MAX_UID_BYTES = 1 << 16;
+
+    size_t list_count;
+    size_t default_probes;
+    AlignedFloats centroids;
+    std::vector<List> inverted;
+    // 标识符所在的倒排列表
+    std::unordered_map<std::string, std::vector<uint32_t>> uid_lists;
+    size_t rows = 0;
+    uint64_t row_signature = 0;
+};
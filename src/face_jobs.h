@@ -0,0 +1,265 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-18
+// License: AGPL-3.0
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+/*
+异步任务队列
+--------------------
+请求提交后立即返回任务编号, 由固定数量的工作线程按优先级执行, 结果保留一段时间供查询或长轮询
+队列总深度有上限, 满时拒绝提交(调用方返回 503), 避免突发流量把请求堆积到客户端超时
+高优先级(匹配)任务总是先于低优先级(录入)任务出队, 且低优先级任务最多占用 3/4 的队列容量
+*/
+class FaceJobs
+{
+public:
+    enum Priority
+    {
+        HIGH,
+        LOW,
+        PRIORITY_COUNT
+    };
+
+    // 任务执行体, 写出 HTTP 状态码与响应体
+    typedef std::function<void(int &code, std::string &body)> Work;
+
+    struct Result
+    {
+        // queued / running / done
+        std::string status;
+        int code;
+        std::string body;
+    };
+
+    struct Stats
+    {
+        size_t queued_high;
+        size_t queued_low;
+        size_t running;
+        size_t depth;
+        uint64_t submitted;
+        uint64_t rejected;
+        uint64_t completed;
+        double avg_seconds;
+    };
+
+    FaceJobs(size_t workers, size_t depth, size_t ttl_s)
+        : depth(std::max<size_t>(1, depth)), ttl(std::chrono::seconds(ttl_s))
+    {
+        workers = std::max<size_t>(1, workers);
+        for (size_t i = 0; i < workers; i++)
+        {
+            threads.emplace_back([this]()
+                                 { run(); });
+        }
+        cout << "[JQ] Job queue started, " << workers << " workers, depth " << this->depth << endl;
+    }
+
+    ~FaceJobs()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wakeup.notify_all();
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    // 提交任务, 返回任务编号, 队列已满时返回空字符串
+    std::string submit(Priority priority, Work work)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        expire();
+        size_t queued = queues[HIGH].size() + queues[LOW].size();
+        size_t limit = priority == HIGH ? depth : std::max<size_t>(1, depth - depth / 4);
+        if (queued >= limit)
+        {
+            rejected++;
+            return "";
+        }
+        std::shared_ptr<Job> job = std::make_shared<Job>();
+        job->id = newId();
+        job->work = std::move(work);
+        jobs[job->id] = job;
+        queues[priority].push_back(job);
+        submitted++;
+        wakeup.notify_one();
+        return job->id;
+    }
+
+    /*
+    查询任务结果
+    -----------------
+    wait_ms 大于 0 时最多等待该时长直到任务完成(长轮询)
+    任务不存在或已过期时返回 false
+    */
+    bool result(const std::string &id, size_t wait_ms, Result &out)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        expire();
+        auto found = jobs.find(id);
+        if (found == jobs.end())
+        {
+            return false;
+        }
+        std::shared_ptr<Job> job = found->second;
+        if (wait_ms > 0)
+        {
+            finished.wait_for(lock, std::chrono::milliseconds(wait_ms), [&job, this]()
+                              { return stop || job->status == DONE; });
+        }
+        static const char *names[] = {"queued", "running", "done"};
+        out.status = names[job->status];
+        out.code = job->code;
+        out.body = job->status == DONE ? job->body : "";
+        return true;
+    }
+
+    // 建议客户端重试的间隔(秒), 按排队任务数与平均执行耗时估算
+    size_t retryAfter()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        double seconds = (queues[HIGH].size() + queues[LOW].size()) * avg_seconds / threads.size();
+        return std::min<size_t>(60, std::max<size_t>(1, static_cast<size_t>(std::ceil(seconds))));
+    }
+
+    Stats stats()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        expire();
+        return Stats{queues[HIGH].size(), queues[LOW].size(), running, depth, submitted, rejected, completed, avg_seconds};
+    }
+
+private:
+    enum Status
+    {
+        QUEUED,
+        RUNNING,
+        DONE
+    };
+
+    struct Job
+    {
+        std::string id;
+        Work work;
+        Status status = QUEUED;
+        int code = 0;
+        std::string body;
+    };
+
+    void run()
+    {
+        while (true)
+        {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                // 空闲时按保留时长周期唤醒清理过期结果, 没有新请求时已完成的结果也不会一直驻留内存
+                auto sweep = std::max<std::chrono::steady_clock::duration>(ttl, std::chrono::seconds(1));
+                while (!wakeup.wait_for(lock, sweep, [this]()
+                                        { return stop || !queues[HIGH].empty() || !queues[LOW].empty(); }))
+                {
+                    expire();
+                }
+                if (stop)
+                {
+                    return;
+                }
+                std::deque<std::shared_ptr<Job>> &queue = queues[HIGH].empty() ? queues[LOW] : queues[HIGH];
+                job = queue.front();
+                queue.pop_front();
+                job->status = RUNNING;
+                running++;
+            }
+            auto start = std::chrono::steady_clock::now();
+            int code = 500;
+            std::string body;
+            try
+            {
+                job->work(code, body);
+            }
+            catch (const std::exception &e)
+            {
+                code = 500;
+                body = "{\"state\":false,\"result\":\"服务出错\"}";
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                job->code = code;
+                job->body = std::move(body);
+                job->status = DONE;
+                // 释放执行体持有的请求数据
+                job->work = nullptr;
+                running--;
+                completed++;
+                avg_seconds = completed == 1 ? seconds : avg_seconds * 0.9 + seconds * 0.1;
+                done_order.push_back(std::make_pair(std::chrono::steady_clock::now(), job->id));
+            }
+            finished.notify_all();
+        }
+    }
+
+    // 清理完成后超过保留时长的任务, 调用方需持有 mutex
+    void expire()
+    {
+        auto now = std::chrono::steady_clock::now();
+        while (!done_order.empty() && now - done_order.front().first > ttl)
+        {
+            jobs.erase(done_order.front().second);
+            done_order.pop_front();
+        }
+    }
+
+    std::string newId()
+    {
+        static const char *digits = "0123456789abcdef";
+        std::string id;
+        do
+        {
+            id.clear();
+            for (int i = 0; i < 16; i++)
+            {
+                id += digits[generator() & 15];
+            }
+        } while (jobs.count(id));
+        return id;
+    }
+
+    size_t depth;
+    std::chrono::steady_clock::duration ttl;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable finished;
+    bool stop = false;
+    std::deque<std::shared_ptr<Job>> queues[PRIORITY_COUNT];
+    std::unordered_map<std::string, std::shared_ptr<Job>> jobs;
+    // 已完成任务按完成时间排列, 用于过期清理
+    std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> done_order;
+    std::mt19937_64 generator{std::random_device{}()};
+    size_t running = 0;
+    uint64_t submitted = 0;
+    uint64_t rejected = 0;
+    uint64_t completed = 0;
+    double avg_seconds = 0;
+};
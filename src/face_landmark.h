@@ -0,0 +1,136 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-21
+// License: AGPL-3.0
+#pragma once
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <dlib/image_processing.h>
+#include <dlib/image_transforms.h>
+#include "face_config.h"
+
+using namespace dlib;
+using namespace std;
+
+/*
+关键点模型
+--------------------
+按配置档位选择关键点预测器, 两种模型都可用于 get_face_chip_details 对齐:
+  68: shape_predictor_68_face_landmarks, model/predictor.dat, 约 100MB
+  5:  shape_predictor_5_face_landmarks, model/predictor_5.dat, 约 9MB, 预测更快
+加载时校验关键点数与档位一致, 并在空白图上试算一次对齐, 不兼容时直接报错而不是在请求中失败
+*/
+class FaceLandmark
+{
+public:
+    struct Info
+    {
+        std::string profile;
+        std::string path;
+        unsigned long parts;
+        // 模型文件大小与加载前后常驻内存的增量
+        size_t file_bytes;
+        size_t resident_bytes;
+        double load_ms;
+    };
+
+    // 档位对应的关键点数, 未知档位返回 0
+    static unsigned long profileParts(const std::string &profile)
+    {
+        if (profile == "68")
+        {
+            return 68;
+        }
+        if (profile == "5")
+        {
+            return 5;
+        }
+        return 0;
+    }
+
+    static std::string profilePath(const std::string &profile)
+    {
+        return profile == "5" ? "model/predictor_5.dat" : "model/predictor.dat";
+    }
+
+    // 按全局配置加载
+    static std::shared_ptr<shape_predictor> load(Info *info = nullptr)
+    {
+        const FaceConfig &config = FaceConfig::get();
+        return load(config.landmark_profile, config.landmark_path.empty() ? profilePath(config.landmark_profile) : config.landmark_path, info);
+    }
+
+    // 加载并校验关键点模型, 档位未知、文件缺失或与对齐不兼容时抛出 runtime_error
+    static std::shared_ptr<shape_predictor> load(const std::string &profile, const std::string &path, Info *info = nullptr)
+    {
+        unsigned long expected = profileParts(profile);
+        if (expected == 0)
+        {
+            throw std::runtime_error("unknown landmark profile " + profile + ", expected 68 or 5");
+        }
+        struct stat file_info;
+        if (::stat(path.c_str(), &file_info) != 0)
+        {
+            throw std::runtime_error("landmark model " + path + " not found");
+        }
+        size_t resident_before = residentBytes();
+        auto start = std::chrono::steady_clock::now();
+        std::shared_ptr<shape_predictor> predictor = std::make_shared<shape_predictor>();
+        deserialize(path) >> *predictor;
+        double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        size_t resident_after = residentBytes();
+        if (predictor->num_parts() != expected)
+        {
+            throw std::runtime_error("landmark model " + path + " has " + std::to_string(predictor->num_parts()) +
+                                     " parts, profile " + profile + " expects " + std::to_string(expected));
+        }
+        checkAlignment(*predictor);
+        if (info)
+        {
+            info->profile = profile;
+            info->path = path;
+            info->parts = predictor->num_parts();
+            info->file_bytes = static_cast<size_t>(file_info.st_size);
+            info->resident_bytes = resident_after > resident_before ? resident_after - resident_before : 0;
+            info->load_ms = load_ms;
+        }
+        cout << "[LM] Landmark model " << path << " loaded, " << expected << " parts, " << load_ms << " ms" << endl;
+        return predictor;
+    }
+
+    // 当前进程常驻内存(字节), 无法读取时返回 0
+    static size_t residentBytes()
+    {
+        std::ifstream in("/proc/self/statm");
+        size_t total = 0;
+        size_t resident = 0;
+        if (!(in >> total >> resident))
+        {
+            return 0;
+        }
+        return resident * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    }
+
+private:
+    // 在空白图上预测关键点并提取一次图像块, 确认模型输出可用于对齐
+    static void checkAlignment(const shape_predictor &predictor)
+    {
+        try
+        {
+            array2d<unsigned char> blank(200, 200);
+            assign_all_pixels(blank, 128);
+            full_object_detection shape = predictor(blank, rectangle(50, 50, 149, 149));
+            matrix<unsigned char> chip;
+            extract_image_chip(blank, get_face_chip_details(shape, 150, 0.25), chip);
+        }
+        catch (const std::exception &e)
+        {
+            throw std::runtime_error(std::string("landmark model is not compatible with face chip alignment: ") + e.what());
+        }
+    }
+};
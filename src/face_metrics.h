@@ -0,0 +1,299 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-12
+// License: AGPL-3.0
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/*
+分阶段耗时指标
+--------------------
+每个线程首次记录时登记一份自己的计数槽, 之后只写本线程的槽(无锁、无竞争)
+线程退出时计数并入已退出线程的累计槽并注销, 登记表大小只取决于存活线程数
+/metrics 抓取时汇总全部槽, 按 Prometheus 文本格式输出
+*/
+class FaceMetrics
+{
+public:
+    enum Stage
+    {
+        MULTIPART,
+        DECODE,
+        PREPROCESS,
+        DETECT,
+        LANDMARK,
+        CHIP,
+        TRACK,
+        EMBED,
+        BATCH_WAIT,
+        SEARCH,
+        DB_READ,
+        DB_WRITE,
+        STAGE_COUNT
+    };
+
+    // 记录一次阶段耗时
+    static void observe(Stage stage, double seconds)
+    {
+        Slot &slot = local();
+        size_t bucket = 0;
+        while (bucket < LATENCY_BUCKETS && seconds > latencyBounds()[bucket])
+        {
+            bucket++;
+        }
+        increment(slot.latency[stage][bucket], 1);
+        increment(slot.latency_sum_ns[stage], static_cast<uint64_t>(seconds * 1e9));
+    }
+
+    // 记录单张图片检测到的人脸数
+    static void observeFaces(size_t count)
+    {
+        Slot &slot = local();
+        size_t bucket = 0;
+        while (bucket < FACE_BUCKETS && count > faceBounds()[bucket])
+        {
+            bucket++;
+        }
+        increment(slot.faces[bucket], 1);
+        increment(slot.faces_sum, count);
+    }
+
+    // 标记当前线程开始处理请求(在路由前调用)
+    static void markRequestStart()
+    {
+        requestStart() = std::chrono::steady_clock::now();
+    }
+
+    // 记录请求开始至今的耗时(用于请求体与表单解析)
+    static void observeSinceRequestStart(Stage stage)
+    {
+        observe(stage, std::chrono::duration<double>(std::chrono::steady_clock::now() - requestStart()).count());
+    }
+
+    // 汇总输出 Prometheus 文本格式, gauges 为抓取时的瞬时值, counters 为单调递增的累计值(名称以 _total 结尾)
+    static std::string render(const std::vector<std::pair<std::string, double>> &gauges,
+                              const std::vector<std::pair<std::string, uint64_t>> &counters = std::vector<std::pair<std::string, uint64_t>>())
+    {
+        Slot total;
+        {
+            Registry &registry = slots();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            total.add(registry.retired);
+            for (const std::unique_ptr<Slot> &slot : registry.list)
+            {
+                total.add(*slot);
+            }
+        }
+        std::ostringstream out;
+        out << "# HELP face_stage_seconds Latency of each recognition pipeline stage\n";
+        out << "# TYPE face_stage_seconds histogram\n";
+        for (size_t s = 0; s < STAGE_COUNT; s++)
+        {
+            std::string label = std::string("stage=\"") + stageName(static_cast<Stage>(s)) + "\"";
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b <= LATENCY_BUCKETS; b++)
+            {
+                cumulative += total.latency[s][b].load(std::memory_order_relaxed);
+                out << "face_stage_seconds_bucket{" << label << ",le=\"";
+                if (b < LATENCY_BUCKETS)
+                {
+                    out << latencyBounds()[b];
+                }
+                else
+                {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << "\n";
+            }
+            out << "face_stage_seconds_sum{" << label << "} " << total.latency_sum_ns[s].load(std::memory_order_relaxed) / 1e9 << "\n";
+            out << "face_stage_seconds_count{" << label << "} " << cumulative << "\n";
+        }
+        out << "# HELP face_detected_per_image Number of faces detected per image\n";
+        out << "# TYPE face_detected_per_image histogram\n";
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b <= FACE_BUCKETS; b++)
+        {
+            cumulative += total.faces[b].load(std::memory_order_relaxed);
+            out << "face_detected_per_image_bucket{le=\"";
+            if (b < FACE_BUCKETS)
+            {
+                out << faceBounds()[b];
+            }
+            else
+            {
+                out << "+Inf";
+            }
+            out << "\"} " << cumulative << "\n";
+        }
+        out << "face_detected_per_image_sum " << total.faces_sum.load(std::memory_order_relaxed) << "\n";
+        out << "face_detected_per_image_count " << cumulative << "\n";
+        for (const auto &gauge : gauges)
+        {
+            out << "# TYPE " << gauge.first << " gauge\n";
+            out << gauge.first << " " << gauge.second << "\n";
+        }
+        for (const auto &counter : counters)
+        {
+            out << "# TYPE " << counter.first << " counter\n";
+            out << counter.first << " " << counter.second << "\n";
+        }
+        return out.str();
+    }
+
+    static const char *stageName(Stage stage)
+    {
+        static const char *names[STAGE_COUNT] = {"multipart", "decode", "preprocess", "detect", "landmark", "chip",
+                                                 "track", "embed", "batch_wait", "search", "db_read", "db_write"};
+        return names[stage];
+    }
+
+private:
+    static const size_t LATENCY_BUCKETS = 14;
+    static const size_t FACE_BUCKETS = 6;
+
+    static const double *latencyBounds()
+    {
+        static const double bounds[LATENCY_BUCKETS] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                                       0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5};
+        return bounds;
+    }
+
+    static const size_t *faceBounds()
+    {
+        static const size_t bounds[FACE_BUCKETS] = {0, 1, 2, 3, 5, 10};
+        return bounds;
+    }
+
+    // 单线程计数槽, 只有所属线程写入
+    struct Slot
+    {
+        std::atomic<uint64_t> latency[STAGE_COUNT][LATENCY_BUCKETS + 1];
+        std::atomic<uint64_t> latency_sum_ns[STAGE_COUNT];
+        std::atomic<uint64_t> faces[FACE_BUCKETS + 1];
+        std::atomic<uint64_t> faces_sum;
+
+        Slot()
+        {
+            for (size_t s = 0; s < STAGE_COUNT; s++)
+            {
+                for (size_t b = 0; b <= LATENCY_BUCKETS; b++)
+                {
+                    latency[s][b].store(0, std::memory_order_relaxed);
+                }
+                latency_sum_ns[s].store(0, std::memory_order_relaxed);
+            }
+            for (size_t b = 0; b <= FACE_BUCKETS; b++)
+            {
+                faces[b].store(0, std::memory_order_relaxed);
+            }
+            faces_sum.store(0, std::memory_order_relaxed);
+        }
+
+        // 累加另一个槽的计数(调用方持有登记表锁或独占本槽)
+        void add(const Slot &other)
+        {
+            for (size_t s = 0; s < STAGE_COUNT; s++)
+            {
+                for (size_t b = 0; b <= LATENCY_BUCKETS; b++)
+                {
+                    increment(latency[s][b], other.latency[s][b].load(std::memory_order_relaxed));
+                }
+                increment(latency_sum_ns[s], other.latency_sum_ns[s].load(std::memory_order_relaxed));
+            }
+            for (size_t b = 0; b <= FACE_BUCKETS; b++)
+            {
+                increment(faces[b], other.faces[b].load(std::memory_order_relaxed));
+            }
+            increment(faces_sum, other.faces_sum.load(std::memory_order_relaxed));
+        }
+    };
+
+    struct Registry
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Slot>> list;
+        // 已退出线程的累计计数
+        Slot retired;
+    };
+
+    // 线程的槽持有者, 线程退出时把计数并入累计槽并从登记表移除
+    struct Holder
+    {
+        Slot *slot;
+
+        Holder()
+        {
+            Registry &registry = slots();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.list.emplace_back(new Slot());
+            slot = registry.list.back().get();
+        }
+
+        ~Holder()
+        {
+            Registry &registry = slots();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.retired.add(*slot);
+            for (size_t i = 0; i < registry.list.size(); i++)
+            {
+                if (registry.list[i].get() == slot)
+                {
+                    registry.list[i].swap(registry.list.back());
+                    registry.list.pop_back();
+                    break;
+                }
+            }
+        }
+    };
+
+    static Registry &slots()
+    {
+        static Registry registry;
+        return registry;
+    }
+
+    // 当前线程的计数槽(首次访问时登记)
+    static Slot &local()
+    {
+        thread_local Holder holder;
+        return *holder.slot;
+    }
+
+    static std::chrono::steady_clock::time_point &requestStart()
+    {
+        thread_local std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        return start;
+    }
+
+    // 单写者递增, 不需要原子读改写指令
+    static void increment(std::atomic<uint64_t> &counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+};
+
+// 作用域计时, 析构时记录阶段耗时
+class FaceTimer
+{
+public:
+    explicit FaceTimer(FaceMetrics::Stage stage) : stage(stage), start(std::chrono::steady_clock::now()) {}
+
+    ~FaceTimer()
+    {
+        FaceMetrics::observe(stage, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+private:
+    FaceMetrics::Stage stage;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,246 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-09
+// License: AGPL-3.0
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "face_batcher.h"
+#include "face_cache.h"
+#include "face_config.h"
+#include "face_landmark.h"
+#include "face_util.h"
+
+using namespace dlib;
+using namespace std;
+
+/*
+推理副本池
+--------------------
+模型文件只加载一次, 按配置创建 N 个 FaceUtil 副本
+关键点预测器只读共享, 检测器与识别网络每个副本独占
+启用合批时识别网络只由合批执行线程持有, 副本不再各存一份
+请求通过 acquire() 借出空闲副本, 用完自动归还
+配置了批量等待窗口时, 特征提取交给 FaceBatcher 跨请求合批
+配置了缓存预算时, 内容相同的图片直接返回缓存的人脸位置与特征
+*/
+class FacePool
+{
+public:
+    // 借出的副本, 析构时归还
+    class Lease
+    {
+    public:
+        Lease(FacePool *pool, FaceUtil *util) : pool(pool), util(util) {}
+        Lease(Lease &&other) : pool(other.pool), util(other.util)
+        {
+            other.util = nullptr;
+        }
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+        ~Lease()
+        {
+            if (util)
+            {
+                pool->release(util);
+            }
+        }
+
+        FaceUtil *operator->() const
+        {
+            return util;
+        }
+
+        FaceUtil &operator*() const
+        {
+            return *util;
+        }
+
+    private:
+        FacePool *pool;
+        FaceUtil *util;
+    };
+
+    explicit FacePool(const FaceConfig &config)
+    {
+        size_t size = std::max<size_t>(1, config.workers);
+        // 加载共享模型(关键点模型按配置档位选择并校验)
+        std::shared_ptr<shape_predictor> predictor = FaceLandmark::load(&landmark);
+        anet_type recognition;
+        deserialize("model/recognition.dat") >> recognition;
+        if (config.batch_wait_ms > 0)
+        {
+            batcher.reset(new FaceBatcher(recognition, config.batch_size, config.batch_wait_ms, config.batch_runners));
+        }
+        // 创建副本(启用合批时特征全部由合批计算, 副本只做检测与对齐)
+        for (size_t i = 0; i < size; i++)
+        {
+            replicas.emplace_back(new FaceUtil(predictor, batcher ? nullptr : &recognition));
+            idle.push_back(replicas.back().get());
+        }
+        if (config.cache_mb > 0)
+        {
+            cache.reset(new FaceCache(config.cache_mb * 1024 * 1024));
+        }
+        cout << "[FP] Model loaded, " << size << " replicas" << endl;
+    }
+
+    /*
+    获取人脸特征
+    -----------------
+    先查缓存, 未命中时再提取, 检测到人脸的结果写入缓存
+    指定检测区域 roi 时结果与区域相关, 不走缓存
+    */
+    std::vector<matrix<float, 0, 1>> getFaceDescriptors(const std::string &image_data, std::vector<rectangle> *boxes = nullptr, const rectangle &roi = rectangle())
+    {
+        if (!cache || !roi.is_empty())
+        {
+            return extractFaceDescriptors(image_data, boxes, roi);
+        }
+        uint64_t key = FaceCache::hash(image_data);
+        std::vector<matrix<float, 0, 1>> descriptors;
+        if (cache->get(key, image_data, descriptors, boxes))
+        {
+            return descriptors;
+        }
+        std::vector<rectangle> found_boxes;
+        descriptors = extractFaceDescriptors(image_data, &found_boxes);
+        // 未检测到人脸也可能是临时错误, 不缓存
+        if (!descriptors.empty())
+        {
+            cache->put(key, image_data, descriptors, found_boxes);
+        }
+        if (boxes)
+        {
+            *boxes = std::move(found_boxes);
+        }
+        return descriptors;
+    }
+
+    /*
+    提取人脸特征
+    -----------------
+    启用合批时副本只负责检测与对齐, 归还副本后再排队等待批量前向计算
+    */
+    std::vector<matrix<float, 0, 1>> extractFaceDescriptors(const std::string &image_data, std::vector<rectangle> *boxes = nullptr, const rectangle &roi = rectangle())
+    {
+        if (!batcher)
+        {
+            return acquire()->getFaceDescriptors(image_data, boxes, roi);
+        }
+        std::vector<matrix<rgb_pixel>> chips = acquire()->getFaceChips(image_data, boxes, roi);
+        try
+        {
+            return batcher->embed(std::move(chips));
+        }
+        catch (const std::exception &e)
+        {
+            return std::vector<matrix<float, 0, 1>>();
+        }
+    }
+
+    // 人脸图像块提取特征(启用合批时排队合批, 否则借出副本计算)
+    std::vector<matrix<float, 0, 1>> embedChips(std::vector<matrix<rgb_pixel>> &&chips)
+    {
+        if (chips.empty())
+        {
+            return std::vector<matrix<float, 0, 1>>();
+        }
+        if (!batcher)
+        {
+            return acquire()->embed(chips);
+        }
+        return batcher->embed(std::move(chips));
+    }
+
+    // 并行提取多张图片的人脸特征, 并发数不超过副本数
+    std::vector<std::vector<matrix<float, 0, 1>>> getFaceDescriptorsBatch(const std::vector<const std::string *> &images)
+    {
+        std::vector<std::vector<matrix<float, 0, 1>>> results(images.size());
+        std::atomic<size_t> next(0);
+        auto work = [&]()
+        {
+            for (size_t i = next++; i < images.size(); i = next++)
+            {
+                results[i] = getFaceDescriptors(*images[i]);
+            }
+        };
+        size_t parallel = std::min(images.size(), replicas.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < parallel; i++)
+        {
+            threads.emplace_back(work);
+        }
+        // 当前线程也参与处理
+        work();
+        for (std::thread &thread : threads)
+        {
+            thread.join();
+        }
+        return results;
+    }
+
+    // 合批调度器(未启用时为空)
+    const FaceBatcher *getBatcher() const
+    {
+        return batcher.get();
+    }
+
+    // 特征缓存(未启用时为空)
+    FaceCache *getCache() const
+    {
+        return cache.get();
+    }
+
+    // 关键点模型信息
+    const FaceLandmark::Info &getLandmark() const
+    {
+        return landmark;
+    }
+
+    // 借出空闲副本, 全部忙碌时等待
+    Lease acquire()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this]()
+                       { return !idle.empty(); });
+        FaceUtil *util = idle.back();
+        idle.pop_back();
+        return Lease(this, util);
+    }
+
+    size_t size() const
+    {
+        return replicas.size();
+    }
+
+    // 当前空闲副本数
+    size_t idleCount()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return idle.size();
+    }
+
+private:
+    void release(FaceUtil *util)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle.push_back(util);
+        }
+        available.notify_one();
+    }
+
+private:
+    std::vector<std::unique_ptr<FaceUtil>> replicas;
+    std::vector<FaceUtil *> idle;
+    std::mutex mutex;
+    std::condition_variable available;
+    std::unique_ptr<FaceBatcher> batcher;
+    std::unique_ptr<FaceCache> cache;
+    FaceLandmark::Info landmark;
+};
@@ -0,0 +1,460 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-22
+// License: AGPL-3.0
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+#include "face_distance.h"
+
+using namespace std;
+
+typedef std::vector<uint8_t, AlignedAllocator<uint8_t>> AlignedBytes;
+
+// 无训练样本时的逐维取值范围(dlib 特征各维通常在 ±0.5 以内)
+const float FACE_QUANT_RANGE = 0.5f;
+
+/*
+量化编码距离核
+-----------------
+code    一行压缩编码
+probe   待匹配特征(int8 为按维度除以缩放系数后的值)
+weights 逐维权重(int8 为缩放系数的平方, fp16 不使用)
+dim     维度
+bound   平方距离上限, 部分和超过上限即提前放弃并返回部分和
+*/
+typedef float (*FaceCodeKernel)(const uint8_t *code, const float *probe, const float *weights, size_t dim, float bound);
+
+/*
+特征量化
+--------------------
+int8: 逐维对称缩放, 缩放系数按训练样本中该维的最大绝对值(留 5% 余量, 不小于默认范围)计算, 每行 128 字节
+fp16: 半精度浮点, 每行 256 字节
+待匹配特征保持 float, 距离按"float 特征 - 解码后的行"计算(非对称), 只有人脸库一侧引入误差
+由三角不等式, 行的编码误差为 e 时, 真实距离在阈值内的行量化距离不超过 阈值 + e
+error() 为取值在训练范围内的行的误差上界; 超出范围的行被截断, 实际误差由 encode 返回, 由调用方计入
+*/
+class FaceQuant
+{
+public:
+    enum Mode
+    {
+        NONE,
+        INT8,
+        FP16
+    };
+
+    // none / int8 / fp16, 无法识别时返回 NONE
+    static Mode parseMode(const std::string &name)
+    {
+        if (name == "int8")
+        {
+            return INT8;
+        }
+        if (name == "fp16")
+        {
+            return FP16;
+        }
+        return NONE;
+    }
+
+    static std::string modeName(Mode mode)
+    {
+        return mode == INT8 ? "int8" : mode == FP16 ? "fp16" : "none";
+    }
+
+    explicit FaceQuant(Mode mode) : quant_mode(mode), scales(FACE_DIM), weights(FACE_DIM), inverses(FACE_DIM)
+    {
+        applyRanges(std::vector<float>(FACE_DIM, FACE_QUANT_RANGE));
+    }
+
+    Mode mode() const
+    {
+        return quant_mode;
+    }
+
+    // 每行编码字节数
+    size_t codeBytes() const
+    {
+        return quant_mode == INT8 ? FACE_DIM : FACE_DIM * sizeof(uint16_t);
+    }
+
+    // 取值在训练范围内的行的量化误差上界(欧式距离)
+    float error() const
+    {
+        return max_error;
+    }
+
+    // 按样本统计逐维取值范围(不小于默认范围, 避免样本过少时后续行全部截断)
+    void train(const float *rows, size_t count)
+    {
+        std::vector<float> ranges(FACE_DIM, FACE_QUANT_RANGE);
+        for (size_t r = 0; r < count; r++)
+        {
+            for (size_t d = 0; d < FACE_DIM; d++)
+            {
+                ranges[d] = std::max(ranges[d], std::fabs(rows[r * FACE_DIM + d]));
+            }
+        }
+        applyRanges(ranges);
+    }
+
+    // 编码一行(超出训练范围的值截断), 返回该行的实际编码误差(欧式距离)
+    float encode(const float *row, uint8_t *code) const
+    {
+        double error_sq = 0;
+        if (quant_mode == INT8)
+        {
+            for (size_t d = 0; d < FACE_DIM; d++)
+            {
+                float level = std::max(-127.0f, std::min(127.0f, std::round(row[d] * inverses[d])));
+                code[d] = static_cast<uint8_t>(static_cast<int8_t>(level));
+                double diff = row[d] - level * scales[d];
+                error_sq += diff * diff;
+            }
+        }
+        else
+        {
+            uint16_t *halfs = reinterpret_cast<uint16_t *>(code);
+            for (size_t d = 0; d < FACE_DIM; d++)
+            {
+                halfs[d] = toHalf(row[d]);
+                double diff = row[d] - fromHalf(halfs[d]);
+                error_sq += diff * diff;
+            }
+        }
+        return static_cast<float>(std::sqrt(error_sq));
+    }
+
+    // 解码一行
+    void decode(const uint8_t *code, float *row) const
+    {
+        const uint16_t *halfs = reinterpret_cast<const uint16_t *>(code);
+        for (size_t d = 0; d < FACE_DIM; d++)
+        {
+            row[d] = quant_mode == INT8 ? static_cast<int8_t>(code[d]) * scales[d] : fromHalf(halfs[d]);
+        }
+    }
+
+    /*
+    批量扫描压缩编码
+    -----------------
+    与 FaceDistance::scan 相同的遍历方式与候选堆, 返回按量化距离升序排列的候选
+    threshold 需由调用方按 error() 放宽, 候选再用全精度特征重排
+    */
+    std::vector<std::vector<FaceHit>> scan(const uint8_t *codes, size_t count, const std::vector<const float *> &probes, float threshold, size_t k) const
+    {
+        std::vector<std::vector<FaceHit>> heaps(probes.size());
+        if (k == 0 || probes.empty() || !(threshold >= 0))
+        {
+            return heaps;
+        }
+        FaceCodeKernel fn = quant_mode == INT8 ? int8Kernel() : fp16Kernel();
+        const float *row_weights = quant_mode == INT8 ? weights.data() : nullptr;
+        // int8 把缩放折算到待匹配特征上, 内层循环只做转换、相减与乘加
+        std::vector<float> scaled(probes.size() * FACE_DIM);
+        for (size_t p = 0; p < probes.size(); p++)
+        {
+            for (size_t d = 0; d < FACE_DIM; d++)
+            {
+                scaled[p * FACE_DIM + d] = quant_mode == INT8 ? probes[p][d] * inverses[d] : probes[p][d];
+            }
+        }
+        const float limit = threshold * threshold;
+        std::vector<float> bounds(probes.size(), limit);
+        for (auto &heap : heaps)
+        {
+            heap.reserve(k);
+        }
+        const size_t stride = codeBytes();
+        for (size_t r = 0; r < count; r++)
+        {
+            const uint8_t *code = codes + r * stride;
+            for (size_t p = 0; p < probes.size(); p++)
+            {
+                float distance = fn(code, scaled.data() + p * FACE_DIM, row_weights, FACE_DIM, bounds[p]);
+                if (distance > bounds[p])
+                {
+                    continue;
+                }
+                FaceDistance::pushHit(heaps[p], FaceHit{r, distance}, k, bounds[p], limit);
+            }
+        }
+        for (auto &heap : heaps)
+        {
+            std::sort_heap(heap.begin(), heap.end(), FaceDistance::hitLess);
+            for (FaceHit &hit : heap)
+            {
+                hit.distance = std::sqrt(hit.distance);
+            }
+        }
+        return heaps;
+    }
+
+    // 标量实现(兜底)
+    static float l2sqInt8Scalar(const uint8_t *code, const float *probe, const float *weights, size_t dim, float bound)
+    {
+        float sum = 0;
+        size_t i = 0;
+        while (i < dim)
+        {
+            size_t end = std::min(dim, i + FACE_ABANDON_STEP);
+            for (; i < end; i++)
+            {
+                float d = probe[i] - static_cast<int8_t>(code[i]);
+                sum += d * d * weights[i];
+            }
+            if (sum > bound)
+            {
+                return sum;
+            }
+        }
+        return sum;
+    }
+
+    static float l2sqFp16Scalar(const uint8_t *code, const float *probe, const float *, size_t dim, float bound)
+    {
+        const uint16_t *halfs = reinterpret_cast<const uint16_t *>(code);
+        float sum = 0;
+        size_t i = 0;
+        while (i < dim)
+        {
+            size_t end = std::min(dim, i + FACE_ABANDON_STEP);
+            for (; i < end; i++)
+            {
+                float d = probe[i] - fromHalf(halfs[i]);
+                sum += d * d;
+            }
+            if (sum > bound)
+            {
+                return sum;
+            }
+        }
+        return sum;
+    }
+
+#ifdef FACE_DISTANCE_X86
+    // AVX2 + FMA 实现: 每次 16 字节符号扩展为两组 8 个 float
+    __attribute__((target("avx2,fma"))) static float l2sqInt8Avx2(const uint8_t *code, const float *probe, const float *weights, size_t dim, float bound)
+    {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + FACE_ABANDON_STEP <= dim;)
+        {
+            for (size_t end = i + FACE_ABANDON_STEP; i < end; i += 16)
+            {
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(code + i));
+                __m256 c0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+                __m256 c1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(bytes, 8)));
+                __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(probe + i), c0);
+                __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(probe + i + 8), c1);
+                acc0 = _mm256_fmadd_ps(_mm256_mul_ps(d0, _mm256_loadu_ps(weights + i)), d0, acc0);
+                acc1 = _mm256_fmadd_ps(_mm256_mul_ps(d1, _mm256_loadu_ps(weights + i + 8)), d1, acc1);
+            }
+            float sum = hsumAvx2(_mm256_add_ps(acc0, acc1));
+            if (sum > bound)
+            {
+                return sum;
+            }
+        }
+        float sum = hsumAvx2(_mm256_add_ps(acc0, acc1));
+        return sum + l2sqInt8Scalar(code + i, probe + i, weights + i, dim - i, std::numeric_limits<float>::max());
+    }
+
+    // AVX2 + FMA + F16C 实现: 每次 8 个半精度转换为 float
+    __attribute__((target("avx2,fma,f16c"))) static float l2sqFp16Avx2(const uint8_t *code, const float *probe, const float *weights, size_t dim, float bound)
+    {
+        const uint16_t *halfs = reinterpret_cast<const uint16_t *>(code);
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for (; i + FACE_ABANDON_STEP <= dim;)
+        {
+            for (size_t end = i + FACE_ABANDON_STEP; i < end; i += 16)
+            {
+                __m256 c0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(halfs + i)));
+                __m256 c1 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(halfs + i + 8)));
+                __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(probe + i), c0);
+                __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(probe + i + 8), c1);
+                acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+                acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+            }
+            float sum = hsumAvx2(_mm256_add_ps(acc0, acc1));
+            if (sum > bound)
+            {
+                return sum;
+            }
+        }
+        float sum = hsumAvx2(_mm256_add_ps(acc0, acc1));
+        return sum + l2sqFp16Scalar(reinterpret_cast<const uint8_t *>(halfs + i), probe + i, weights, dim - i, std::numeric_limits<float>::max());
+    }
+#endif
+
+    // 运行时选择当前 CPU 支持的最快实现(只检测一次)
+    static FaceCodeKernel int8Kernel()
+    {
+        static const FaceCodeKernel selected = select(INT8);
+        return selected;
+    }
+
+    static FaceCodeKernel fp16Kernel()
+    {
+        static const FaceCodeKernel selected = select(FP16);
+        return selected;
+    }
+
+    // 当前实现名称
+    static std::string kernelName(Mode mode)
+    {
+        if (mode == NONE)
+        {
+            return FaceDistance::kernelName();
+        }
+#ifdef FACE_DISTANCE_X86
+        FaceCodeKernel k = mode == INT8 ? int8Kernel() : fp16Kernel();
+        if (k == &l2sqInt8Avx2 || k == &l2sqFp16Avx2)
+            return "avx2";
+#endif
+        return "scalar";
+    }
+
+    // float 转半精度(就近舍入到偶数, 超出范围为无穷大)
+    static uint16_t toHalf(float value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+        uint32_t exponent = (bits >> 23) & 0xff;
+        uint32_t mantissa = bits & 0x7fffff;
+        if (exponent == 0xff)
+        {
+            return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+        }
+        int32_t half_exponent = static_cast<int32_t>(exponent) - 127 + 15;
+        if (half_exponent >= 31)
+        {
+            return sign | 0x7c00;
+        }
+        if (half_exponent <= 0)
+        {
+            // 非规格化数(过小时为 0)
+            if (half_exponent < -10)
+            {
+                return sign;
+            }
+            mantissa |= 0x800000;
+            uint32_t shift = static_cast<uint32_t>(14 - half_exponent);
+            uint32_t half_mantissa = mantissa >> shift;
+            uint32_t rest = mantissa & ((1u << shift) - 1);
+            uint32_t middle = 1u << (shift - 1);
+            if (rest > middle || (rest == middle && (half_mantissa & 1)))
+            {
+                half_mantissa++;
+            }
+            return sign | static_cast<uint16_t>(half_mantissa);
+        }
+        uint32_t half = (static_cast<uint32_t>(half_exponent) << 10) | (mantissa >> 13);
+        uint32_t rest = mantissa & 0x1fff;
+        // 进位可能溢出到指数位, 结果仍然正确(最大时进位为无穷大)
+        if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        {
+            half++;
+        }
+        return sign | static_cast<uint16_t>(half);
+    }
+
+    // 半精度转 float
+    static float fromHalf(uint16_t half)
+    {
+        uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+        uint32_t exponent = (half >> 10) & 0x1f;
+        uint32_t mantissa = half & 0x3ff;
+        uint32_t bits;
+        if (exponent == 0x1f)
+        {
+            bits = sign | 0x7f800000 | (mantissa << 13);
+        }
+        else if (exponent != 0)
+        {
+            bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        }
+        else if (mantissa == 0)
+        {
+            bits = sign;
+        }
+        else
+        {
+            // 非规格化数: 规格化后重新计算指数
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400))
+            {
+                mantissa <<= 1;
+                exponent--;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+private:
+    // 按逐维最大绝对值计算缩放系数与误差上界
+    void applyRanges(const std::vector<float> &ranges)
+    {
+        double error_sq = 0;
+        for (size_t d = 0; d < FACE_DIM; d++)
+        {
+            float range = std::max(ranges[d] * 1.05f, 1e-6f);
+            scales[d] = range / 127;
+            weights[d] = scales[d] * scales[d];
+            inverses[d] = 1 / scales[d];
+            // int8 舍入误差不超过半个量化步长; fp16 相对误差不超过 2^-11
+            double step = quant_mode == INT8 ? scales[d] / 2 : range / 2048;
+            error_sq += step * step;
+        }
+        max_error = static_cast<float>(std::sqrt(error_sq));
+    }
+
+    static FaceCodeKernel select(Mode mode)
+    {
+#ifdef FACE_DISTANCE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            if (mode == INT8)
+            {
+                return &l2sqInt8Avx2;
+            }
+            // F16C 没有对应的 __builtin_cpu_supports 名称, 支持 AVX2 的处理器均支持 F16C
+            return &l2sqFp16Avx2;
+        }
+#endif
+        return mode == INT8 ? &l2sqInt8Scalar : &l2sqFp16Scalar;
+    }
+
+#ifdef FACE_DISTANCE_X86
+    __attribute__((target("avx2"))) static float hsumAvx2(__m256 v)
+    {
+        __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        __m128 shuf = _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(2, 3, 0, 1));
+        __m128 sums = _mm_add_ps(lo, shuf);
+        shuf = _mm_movehl_ps(shuf, sums);
+        sums = _mm_add_ss(sums, shuf);
+        return _mm_cvtss_f32(sums);
+    }
+#endif
+
+    Mode quant_mode;
+    // 逐维缩放系数、其平方与倒数(仅 int8 使用)
+    std::vector<float> scales;
+    std::vector<float> weights;
+    std::vector<float> inverses;
+    float max_error = 0;
+};
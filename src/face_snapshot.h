@@ -0,0 +1,368 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-15
+// License: AGPL-3.0
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "face_distance.h"
+
+using namespace std;
+
+/*
+人脸库快照
+--------------------
+与数据库同目录的二进制文件, 按分组保存连续特征矩阵、uid 表和写出时已应用的变更日志序号
+启动时顺序读取, 特征直接读入人脸库最终使用的矩阵(不经过映射与中间拷贝), 只需回放变更日志中序号更大的条目
+写出时先写临时文件并 fsync, 再替换原文件并 fsync 所在目录; 头部的 CRC32C 覆盖整个文件, 截断或损坏的快照不会被加载
+文件布局(本机字节序, 以字节序标记校验):
+  头部 64 字节: 魔数 "FSNP" | 版本 | 维度 | 字节序标记 | 分组数 | 日志序号 | CRC32C(计算时此字段按 0)
+  每个分组: 分组名长度 uint32 | 分组名 | 行数 uint64 | uid 总字节数 uint64 | 补零至 64 字节对齐
+            特征矩阵 行数 x 维度 float32 | uid 长度表 行数 x uint32 | uid 内容依次拼接
+*/
+class FaceSnapshot
+{
+public:
+    // 单个分组的数据(特征矩阵与人脸库同类型, 加载后直接交给人脸库接管)
+    struct Part
+    {
+        std::string group;
+        SpillFloats faces;
+        std::vector<std::string> uids;
+    };
+
+    // 写出快照(先写临时文件并落盘再替换, 不会留下半个文件)
+    static bool save(const std::string &path, const std::vector<Part> &parts, int64_t log_seq)
+    {
+        std::string temp_path = path + ".tmp";
+        int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        char header[HEADER_SIZE] = {0};
+        std::memcpy(header, fileMagic(), 4);
+        putValue<uint32_t>(header + 4, FILE_VERSION);
+        putValue<uint32_t>(header + 8, FACE_DIM);
+        putValue<uint32_t>(header + 12, BYTE_ORDER_MARK);
+        putValue<uint64_t>(header + 16, parts.size());
+        putValue<int64_t>(header + 24, log_seq);
+        uint32_t crc = 0;
+        bool ok = writeFull(fd, header, HEADER_SIZE, crc);
+        uint64_t offset = HEADER_SIZE;
+        for (size_t p = 0; p < parts.size() && ok; p++)
+        {
+            const Part &part = parts[p];
+            std::vector<uint32_t> lengths;
+            std::string text;
+            lengths.reserve(part.uids.size());
+            for (const std::string &uid : part.uids)
+            {
+                lengths.push_back(uid.size());
+                text += uid;
+            }
+            std::string meta(sizeof(uint32_t) + part.group.size() + 2 * sizeof(uint64_t), '\0');
+            putValue<uint32_t>(&meta[0], part.group.size());
+            std::memcpy(&meta[sizeof(uint32_t)], part.group.data(), part.group.size());
+            putValue<uint64_t>(&meta[sizeof(uint32_t) + part.group.size()], part.uids.size());
+            putValue<uint64_t>(&meta[sizeof(uint32_t) + part.group.size() + sizeof(uint64_t)], text.size());
+            offset += meta.size();
+            // 特征矩阵按 64 字节对齐
+            meta.append(paddingFor(offset), '\0');
+            offset += paddingFor(offset);
+            ok = writeFull(fd, meta.data(), meta.size(), crc) &&
+                 writeFull(fd, part.faces.data(), part.uids.size() * FACE_DIM * sizeof(float), crc) &&
+                 writeFull(fd, lengths.data(), lengths.size() * sizeof(uint32_t), crc) &&
+                 writeFull(fd, text.data(), text.size(), crc);
+            offset += part.uids.size() * (FACE_DIM * sizeof(float) + sizeof(uint32_t)) + text.size();
+        }
+        // 校验和写回头部后落盘
+        putValue<uint32_t>(header + CRC_OFFSET, crc);
+        ok = ok && ::pwrite(fd, header, HEADER_SIZE, 0) == static_cast<ssize_t>(HEADER_SIZE) && ::fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+        if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        syncDirectory(path);
+        return true;
+    }
+
+    // 读取快照, 文件缺失、版本不符、长度不一致或校验和不符时返回 false
+    static bool load(const std::string &path, std::vector<Part> &parts, int64_t &log_seq)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(HEADER_SIZE))
+        {
+            ::close(fd);
+            return false;
+        }
+        // 顺序读取, 提示内核提前预读
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        bool ok = parse(fd, static_cast<uint64_t>(info.st_size), parts, log_seq);
+        ::close(fd);
+        return ok;
+    }
+
+    // CRC32C(Castagnoli), 支持 SSE4.2 时使用硬件指令
+    static uint32_t crc32c(uint32_t crc, const void *data, size_t size)
+    {
+        static const Crc32cKernel kernel = selectCrc32c();
+        return kernel(crc, static_cast<const unsigned char *>(data), size);
+    }
+
+private:
+    static const size_t HEADER_SIZE = 64;
+    static const size_t CRC_OFFSET = 32;
+    // 版本 3 起头部记录日志序号(此前为行 id), 版本 4 起头部带校验和
+    static const uint32_t FILE_VERSION = 4;
+    static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+    // 单次读写的块大小(读入后立即计算校验和, 数据仍在缓存中)
+    static const size_t IO_CHUNK = 4 << 20;
+
+    typedef uint32_t (*Crc32cKernel)(uint32_t crc, const unsigned char *data, size_t size);
+
+    static size_t paddingFor(uint64_t offset)
+    {
+        return (HEADER_SIZE - offset % HEADER_SIZE) % HEADER_SIZE;
+    }
+
+    // 写满 size 字节并累计校验和
+    static bool writeFull(int fd, const void *data, size_t size, uint32_t &crc)
+    {
+        const char *cursor = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            ssize_t written = ::write(fd, cursor, size < IO_CHUNK ? size : IO_CHUNK);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+            crc = crc32c(crc, cursor, written);
+            cursor += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    // 读满 size 字节并累计校验和
+    static bool readFull(int fd, void *data, size_t size, uint32_t &crc)
+    {
+        char *cursor = static_cast<char *>(data);
+        while (size > 0)
+        {
+            ssize_t got = ::read(fd, cursor, size < IO_CHUNK ? size : IO_CHUNK);
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                return false;
+            }
+            crc = crc32c(crc, cursor, got);
+            cursor += got;
+            size -= got;
+        }
+        return true;
+    }
+
+    // 替换后落盘所在目录, 确保重命名本身在掉电后仍然有效
+    static void syncDirectory(const std::string &path)
+    {
+        size_t slash = path.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd >= 0)
+        {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    static bool parse(int fd, uint64_t size, std::vector<Part> &parts, int64_t &log_seq)
+    {
+        char header[HEADER_SIZE];
+        uint32_t header_crc = 0;
+        if (!readFull(fd, header, HEADER_SIZE, header_crc))
+        {
+            return false;
+        }
+        uint32_t file_crc = getValue<uint32_t>(header + CRC_OFFSET);
+        // 校验和按该字段为 0 计算
+        putValue<uint32_t>(header + CRC_OFFSET, 0);
+        uint32_t crc = crc32c(0, header, HEADER_SIZE);
+        if (std::memcmp(header, fileMagic(), 4) != 0 || getValue<uint32_t>(header + 4) != FILE_VERSION ||
+            getValue<uint32_t>(header + 8) != FACE_DIM || getValue<uint32_t>(header + 12) != BYTE_ORDER_MARK)
+        {
+            return false;
+        }
+        uint64_t part_count = getValue<uint64_t>(header + 16);
+        int64_t file_log_seq = getValue<int64_t>(header + 24);
+        std::vector<Part> file_parts;
+        uint64_t offset = HEADER_SIZE;
+        for (uint64_t p = 0; p < part_count; p++)
+        {
+            uint32_t group_length;
+            if (size - offset < sizeof(uint32_t) || !readFull(fd, &group_length, sizeof(uint32_t), crc))
+            {
+                return false;
+            }
+            offset += sizeof(uint32_t);
+            if (size - offset < group_length + 2 * sizeof(uint64_t))
+            {
+                return false;
+            }
+            Part part;
+            part.group.resize(group_length);
+            uint64_t counts[2];
+            if (!readFull(fd, &part.group[0], group_length, crc) || !readFull(fd, counts, sizeof(counts), crc))
+            {
+                return false;
+            }
+            offset += group_length + sizeof(counts);
+            uint64_t count = counts[0];
+            uint64_t uid_bytes = counts[1];
+            char padding[HEADER_SIZE];
+            size_t padding_bytes = paddingFor(offset);
+            if (size - offset < padding_bytes || !readFull(fd, padding, padding_bytes, crc))
+            {
+                return false;
+            }
+            offset += padding_bytes;
+            size_t row_bytes = FACE_DIM * sizeof(float) + sizeof(uint32_t);
+            if (count > (size - offset) / row_bytes || uid_bytes > size - offset - count * row_bytes)
+            {
+                return false;
+            }
+            // 特征直接读入最终的矩阵
+            part.faces.resize(count * FACE_DIM);
+            std::vector<uint32_t> lengths(count);
+            std::string text(uid_bytes, '\0');
+            if (!readFull(fd, part.faces.data(), count * FACE_DIM * sizeof(float), crc) ||
+                !readFull(fd, lengths.data(), count * sizeof(uint32_t), crc) ||
+                !readFull(fd, &text[0], uid_bytes, crc))
+            {
+                return false;
+            }
+            part.uids.reserve(count);
+            uint64_t consumed = 0;
+            for (uint64_t i = 0; i < count; i++)
+            {
+                if (lengths[i] > uid_bytes - consumed)
+                {
+                    return false;
+                }
+                part.uids.emplace_back(text, consumed, lengths[i]);
+                consumed += lengths[i];
+            }
+            if (consumed != uid_bytes)
+            {
+                return false;
+            }
+            offset += count * row_bytes + uid_bytes;
+            file_parts.push_back(std::move(part));
+        }
+        if (offset != size || crc != file_crc)
+        {
+            return false;
+        }
+        parts.swap(file_parts);
+        log_seq = file_log_seq;
+        return true;
+    }
+
+    static Crc32cKernel selectCrc32c()
+    {
+#ifdef FACE_DISTANCE_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2"))
+        {
+            return &crc32cSse42;
+        }
+#endif
+        return &crc32cScalar;
+    }
+
+    static uint32_t crc32cScalar(uint32_t crc, const unsigned char *data, size_t size)
+    {
+        static const std::vector<uint32_t> table = []()
+        {
+            std::vector<uint32_t> entries(256);
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                uint32_t value = i;
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    value = (value >> 1) ^ (value & 1 ? 0x82f63b78u : 0);
+                }
+                entries[i] = value;
+            }
+            return entries;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++)
+        {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+#ifdef FACE_DISTANCE_X86
+    __attribute__((target("sse4.2"))) static uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t size)
+    {
+        crc = ~crc;
+#ifdef __x86_64__
+        uint64_t wide = crc;
+        for (; size >= 8; data += 8, size -= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data, 8);
+            wide = _mm_crc32_u64(wide, word);
+        }
+        crc = static_cast<uint32_t>(wide);
+#endif
+        for (; size > 0; data++, size--)
+        {
+            crc = _mm_crc32_u8(crc, *data);
+        }
+        return ~crc;
+    }
+#endif
+
+    template <typename T>
+    static void putValue(char *out, T value)
+    {
+        std::memcpy(out, &value, sizeof(T));
+    }
+
+    template <typename T>
+    static T getValue(const char *in)
+    {
+        T value;
+        std::memcpy(&value, in, sizeof(T));
+        return value;
+    }
+
+    static const char *fileMagic()
+    {
+        return "FSNP";
+    }
+};
@@ -0,0 +1,467 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-17
+// License: AGPL-3.0
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <dlib/image_processing.h>
+#include "../nlohmann/json.hpp"
+#include "face_config.h"
+#include "face_gallery.h"
+#include "face_image.h"
+#include "face_metrics.h"
+#include "face_pool.h"
+
+using json = nlohmann::json;
+
+using namespace dlib;
+using namespace std;
+
+/*
+视频流人脸跟踪会话
+--------------------
+每 N 帧运行一次人脸检测, 其余帧用 correlation_tracker 在缩小的灰度检测图上跟踪已有人脸
+每条轨迹只在首次出现或人脸明显变大(质量提升)时提取特征并匹配, 不再逐帧跑关键点与识别网络
+匹配结果变化与轨迹丢失时产生事件
+*/
+class FaceStreamSession
+{
+public:
+    struct Settings
+    {
+        std::string group;
+        float threshold;
+        size_t detect_every;
+    };
+
+    explicit FaceStreamSession(const Settings &settings) : settings(settings) {}
+
+    /*
+    处理一帧
+    -----------------
+    frame   JPEG/PNG 编码的帧
+    gallery 匹配所用的分组人脸库
+    events  追加本帧产生的事件
+    */
+    bool processFrame(const std::string &frame, FacePool &pool, const FaceGallery &gallery, json &events)
+    {
+        // 原图与检测视图缓冲在会话内逐帧复用
+        {
+            FaceTimer timer(FaceMetrics::DECODE);
+            if (!FaceImage::decode(frame, original))
+            {
+                return false;
+            }
+        }
+        {
+            FaceTimer timer(FaceMetrics::PREPROCESS);
+            preprocess_face_image(original, view);
+        }
+        size_t index = frames++;
+        // 更新已有轨迹, 跟踪置信度过低的轨迹视为丢失
+        {
+            FaceTimer timer(FaceMetrics::TRACK);
+            for (Track &track : tracks)
+            {
+                track.confidence = track.tracker.update(view.gray);
+                track.box = toRectangle(track.tracker.get_position());
+            }
+        }
+        std::vector<size_t> refreshed;
+        std::vector<matrix<rgb_pixel>> chips;
+        if (index % std::max<size_t>(1, settings.detect_every) == 0)
+        {
+            detect_frames++;
+            FacePool::Lease util = pool.acquire();
+            std::vector<rectangle> detected = util->detectFaces(view);
+            std::vector<bool> seen(tracks.size(), false);
+            for (const rectangle &face : detected)
+            {
+                // 与已有轨迹按重叠度关联, 关联不上时新建轨迹
+                size_t best = tracks.size();
+                double best_overlap = MIN_OVERLAP;
+                for (size_t t = 0; t < tracks.size(); t++)
+                {
+                    double value = overlap(face, tracks[t].box);
+                    if (!seen[t] && value >= best_overlap)
+                    {
+                        best = t;
+                        best_overlap = value;
+                    }
+                }
+                if (best == tracks.size())
+                {
+                    tracks.emplace_back();
+                    tracks.back().id = next_track++;
+                    seen.push_back(false);
+                }
+                Track &track = tracks[best];
+                seen[best] = true;
+                track.tracker.start_track(view.gray, drectangle(face));
+                track.box = face;
+                track.confidence = TRACK_CONFIDENCE;
+                track.misses = 0;
+                // 首次出现或人脸明显变大时重新提取特征
+                double quality = static_cast<double>(face.area());
+                if (!track.embedded || quality > track.quality * QUALITY_GAIN)
+                {
+                    track.quality = quality;
+                    chips.push_back(util->faceChip(original, view.toOriginal(face)));
+                    refreshed.push_back(best);
+                }
+            }
+            for (size_t t = 0; t < seen.size(); t++)
+            {
+                if (!seen[t])
+                {
+                    tracks[t].misses++;
+                }
+            }
+        }
+        // 归还副本后再提取特征, 避免单副本时与合批互相等待
+        if (!chips.empty())
+        {
+            std::vector<matrix<float, 0, 1>> descriptors = pool.embedChips(std::move(chips));
+            embeddings += descriptors.size();
+            std::vector<std::vector<FaceGallery::Match>> found;
+            if (!gallery.empty())
+            {
+                found = gallery.search(descriptors, settings.threshold, 1);
+            }
+            for (size_t i = 0; i < refreshed.size() && i < descriptors.size(); i++)
+            {
+                Track &track = tracks[refreshed[i]];
+                std::string uid = i < found.size() && !found[i].empty() ? found[i][0].uid : "";
+                float distance = uid.empty() ? 0 : found[i][0].distance;
+                bool changed = !track.embedded || uid != track.uid;
+                track.embedded = true;
+                track.uid = uid;
+                if (changed)
+                {
+                    json event = trackEvent(track, index, uid.empty() ? "unknown" : "match");
+                    if (!uid.empty())
+                    {
+                        event["distance"] = distance;
+                    }
+                    events.push_back(event);
+                }
+            }
+        }
+        // 清理丢失的轨迹
+        for (size_t t = 0; t < tracks.size();)
+        {
+            if (tracks[t].confidence < MIN_CONFIDENCE || tracks[t].misses > MAX_MISSES)
+            {
+                events.push_back(trackEvent(tracks[t], index, "lost"));
+                tracks.erase(tracks.begin() + t);
+            }
+            else
+            {
+                t++;
+            }
+        }
+        return true;
+    }
+
+    json stats() const
+    {
+        json result;
+        result["frames"] = frames;
+        result["detect_frames"] = detect_frames;
+        result["embeddings"] = embeddings;
+        result["tracks"] = tracks.size();
+        return result;
+    }
+
+    const Settings &getSettings() const
+    {
+        return settings;
+    }
+
+    // 会话处理期间持有, 同一会话的帧按顺序处理
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point last_used = std::chrono::steady_clock::now();
+
+private:
+    // 检测框与轨迹框的最小重叠度(交并比)
+    static constexpr double MIN_OVERLAP = 0.3;
+    // 跟踪峰值旁瓣比低于此值视为丢失
+    static constexpr double MIN_CONFIDENCE = 7.0;
+    // 检测刷新后的初始置信度
+    static constexpr double TRACK_CONFIDENCE = 100.0;
+    // 人脸面积超过已提取时的倍数才重新提取特征
+    static constexpr double QUALITY_GAIN = 1.25;
+    // 连续多少次检测未命中后丢弃轨迹
+    static const size_t MAX_MISSES = 1;
+
+    struct Track
+    {
+        long id = 0;
+        correlation_tracker tracker;
+        rectangle box;
+        double confidence = 0;
+        double quality = 0;
+        size_t misses = 0;
+        bool embedded = false;
+        std::string uid;
+    };
+
+    static rectangle toRectangle(const drectangle &box)
+    {
+        return rectangle(std::lround(box.left()), std::lround(box.top()), std::lround(box.right()), std::lround(box.bottom()));
+    }
+
+    static double overlap(const rectangle &a, const rectangle &b)
+    {
+        double inner = static_cast<double>(a.intersect(b).area());
+        double outer = static_cast<double>(a.area() + b.area()) - inner;
+        return outer > 0 ? inner / outer : 0;
+    }
+
+    json trackEvent(const Track &track, size_t frame, const std::string &type) const
+    {
+        json event;
+        event["frame"] = frame;
+        event["track"] = track.id;
+        event["type"] = type;
+        if (!track.uid.empty())
+        {
+            event["uid"] = track.uid;
+        }
+        // 换算回原图坐标
+        rectangle box = view.toOriginal(track.box);
+        event["box"] = {{"left", box.left()}, {"top", box.top()}, {"right", box.right()}, {"bottom", box.bottom()}};
+        return event;
+    }
+
+    Settings settings;
+    array2d<rgb_pixel> original;
+    FaceDetectionView view;
+    std::vector<Track> tracks;
+    long next_track = 1;
+    size_t frames = 0;
+    size_t detect_frames = 0;
+    size_t embeddings = 0;
+};
+
+// 视频流会话表, 空闲超时的会话在新建会话时清理
+class FaceStreams
+{
+public:
+    std::shared_ptr<FaceStreamSession> open(const FaceStreamSession::Settings &settings, std::string &id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        prune();
+        id = newId();
+        std::shared_ptr<FaceStreamSession> session = std::make_shared<FaceStreamSession>(settings);
+        sessions[id] = session;
+        return session;
+    }
+
+    std::shared_ptr<FaceStreamSession> find(const std::string &id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = sessions.find(id);
+        return found == sessions.end() ? nullptr : found->second;
+    }
+
+    bool close(const std::string &id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sessions.erase(id) > 0;
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return sessions.size();
+    }
+
+private:
+    void prune()
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto idle = std::chrono::seconds(FaceConfig::get().stream_idle_s);
+        for (auto it = sessions.begin(); it != sessions.end();)
+        {
+            // 正在处理帧的会话不清理
+            std::unique_lock<std::mutex> busy(it->second->mutex, std::try_to_lock);
+            if (busy.owns_lock() && now - it->second->last_used > idle)
+            {
+                busy.unlock();
+                it = sessions.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    std::string newId()
+    {
+        static const char *digits = "0123456789abcdef";
+        std::string id;
+        do
+        {
+            id.clear();
+            for (int i = 0; i < 16; i++)
+            {
+                id += digits[generator() & 15];
+            }
+        } while (sessions.count(id));
+        return id;
+    }
+
+    std::mutex mutex;
+    std::map<std::string, std::shared_ptr<FaceStreamSession>> sessions;
+    std::mt19937_64 generator{std::random_device{}()};
+};
+
+/*
+MJPEG 分帧
+--------------------
+从连续上传的字节流中切出完整 JPEG 帧, 边界头等帧间字节忽略
+找到起始标记(FFD8)后按段长度逐段跳过(EXIF 缩略图等内嵌的 FFD8...FFD9 在 APP 段内, 不会被误认为帧结束),
+SOS 之后在熵编码数据中查找下一个标记(FF00 与 RSTn 除外), 遇到 EOI(FFD9)即为帧结束
+段结构不合法时跳过该起始标记重新同步; 单帧超过上限仍未结束时丢弃该帧直到其结束标记, 避免异常输入占满内存
+*/
+class MjpegSplitter
+{
+public:
+    explicit MjpegSplitter(size_t max_frame) : max_frame(max_frame) {}
+
+    template <typename Callback>
+    void feed(const char *data, size_t size, Callback on_frame)
+    {
+        buffer.append(data, size);
+        while (true)
+        {
+            if (!in_frame)
+            {
+                size_t start = buffer.find("\xFF\xD8");
+                if (start == std::string::npos)
+                {
+                    // 保留末尾一个字节, 标记可能跨块
+                    buffer.erase(0, buffer.empty() ? 0 : buffer.size() - 1);
+                    return;
+                }
+                buffer.erase(0, start);
+                in_frame = true;
+                in_scan = false;
+                discarding = false;
+                cursor = 2;
+            }
+            int state = walk();
+            if (state == 0)
+            {
+                if (buffer.size() > max_frame || discarding)
+                {
+                    // 超长帧只保留解析位置, 已解析的字节丢弃, 继续找它的结束标记
+                    size_t parsed = std::min(cursor, buffer.size());
+                    buffer.erase(0, parsed);
+                    cursor -= parsed;
+                    discarding = true;
+                }
+                return;
+            }
+            if (discarding || (state > 0 && cursor > max_frame))
+            {
+                discarded++;
+            }
+            else if (state > 0)
+            {
+                on_frame(buffer.substr(0, cursor));
+            }
+            buffer.erase(0, state > 0 ? cursor : 1);
+            in_frame = false;
+            discarding = false;
+        }
+    }
+
+    // 因超过上限被丢弃的帧数
+    size_t dropped() const
+    {
+        return discarded;
+    }
+
+private:
+    // 从 cursor 继续解析当前帧: 1 帧结束(cursor 指向 EOI 之后), 0 数据不足, -1 结构不合法
+    int walk()
+    {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(buffer.data());
+        size_t size = buffer.size();
+        while (true)
+        {
+            if (in_scan)
+            {
+                while (cursor + 1 < size && !(bytes[cursor] == 0xFF && bytes[cursor + 1] != 0x00 && (bytes[cursor + 1] < 0xD0 || bytes[cursor + 1] > 0xD7)))
+                {
+                    cursor++;
+                }
+                if (cursor + 1 >= size)
+                {
+                    return 0;
+                }
+                in_scan = false;
+            }
+            if (cursor + 1 >= size)
+            {
+                return 0;
+            }
+            unsigned char marker = bytes[cursor + 1];
+            if (bytes[cursor] != 0xFF || marker == 0x00 || marker == 0xD8)
+            {
+                return -1;
+            }
+            if (marker == 0xFF)
+            {
+                // 标记前的填充字节
+                cursor++;
+                continue;
+            }
+            if (marker == 0xD9)
+            {
+                cursor += 2;
+                return 1;
+            }
+            if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+            {
+                // 无长度字段的标记
+                cursor += 2;
+                continue;
+            }
+            if (cursor + 3 >= size)
+            {
+                return 0;
+            }
+            size_t length = (static_cast<size_t>(bytes[cursor + 2]) << 8) | bytes[cursor + 3];
+            if (length < 2)
+            {
+                return -1;
+            }
+            cursor += 2 + length;
+            in_scan = marker == 0xDA;
+        }
+    }
+
+    size_t max_frame;
+    std::string buffer;
+    // 缓冲区开头是否为已找到起始标记的帧
+    bool in_frame = false;
+    // 是否位于 SOS 之后的熵编码数据中
+    bool in_scan = false;
+    // 当前帧已解析到的位置
+    size_t cursor = 0;
+    // 当前帧已超过上限, 只解析结构不保留数据
+    bool discarding = false;
+    size_t discarded = 0;
+};
@@ -3,7 +3,10 @@
 // License: AGPL-3.0
 #pragma once
 
+#include <cmath>
 #include <cstdio>
+#include <memory>
+#include <stdexcept>
 #include <dlib/clustering.h>
 #include <dlib/matrix.h>
 #include <dlib/string.h>
@@ -12,91 +15,240 @@
 #include <dlib/image_processing.h>
 #include <dlib/image_processing/frontal_face_detector.h>
 #include "network_model.h"
+#include "face_detector.h"
+#include "face_distance.h"
+#include "face_image.h"
+#include "face_landmark.h"
+#include "face_metrics.h"
 
 using namespace dlib;
 using namespace std;
 
+/*
+检测视图
+--------------------
+原图(或指定区域)按检测宽度缩小后的灰度图, 只用于人脸检测与跟踪
+缓冲随推理副本或视频流会话复用, 尺寸不变时不重新分配
+关键点与人脸图像块从原始分辨率的原图提取
+*/
+struct FaceDetectionView
+{
+    array2d<unsigned char> gray;
+    // 缩小时的彩色中间缓冲
+    array2d<rgb_pixel> scaled;
+    // 检测图相对原图的缩放比例
+    double scale = 1.0;
+    // 检测区域在原图中的位置
+    rectangle roi;
+
+    // 检测图坐标换算回原图坐标
+    rectangle toOriginal(const rectangle &rect) const
+    {
+        return rectangle(roi.left() + std::lround(rect.left() / scale), roi.top() + std::lround(rect.top() / scale),
+                         roi.left() + std::lround(rect.right() / scale), roi.top() + std::lround(rect.bottom() / scale));
+    }
+};
+
+// 预处理图像: 将指定区域(为空时取整图)按检测宽度缩小并转灰度写入检测视图, 返回相对原图的缩放比例
 template <typename image_type>
-void preprocess_face_image(image_type &img)
+double preprocess_face_image(const image_type &img, FaceDetectionView &view, const rectangle &roi = rectangle())
 {
+    const FaceConfig &config = FaceConfig::get();
+    view.roi = roi.is_empty() ? get_rect(img) : get_rect(img).intersect(roi);
+    view.scale = 1.0;
+    if (view.roi.is_empty())
+    {
+        view.gray.set_size(0, 0);
+        return view.scale;
+    }
     // 调整图像大小
-    long original_width = img.nc();
-    long original_height = img.nr();
-    if (original_width > 360)
+    if (config.detect_width > 0 && view.roi.width() > config.detect_width)
     {
-        double scale_factor = 360.0 / original_width;
-        long new_width = static_cast<long>(original_width * scale_factor);
-        long new_height = static_cast<long>(original_height * scale_factor);
-
-        array2d<rgb_pixel> resized_img(new_height, new_width);
-        resize_image(img, resized_img);
-        assign_image(img, resized_img);
+        view.scale = static_cast<double>(config.detect_width) / view.roi.width();
+        view.scaled.set_size(std::max(1L, static_cast<long>(view.roi.height() * view.scale)), static_cast<long>(config.detect_width));
+        resize_image(sub_image(img, view.roi), view.scaled);
+        // 转灰度图
+        assign_image(view.gray, view.scaled);
     }
-    // 转灰度图
-    matrix<unsigned char> gray_img;
-    assign_image(gray_img, img);
-    assign_image(img, gray_img);
-    dlib::save_jpeg(img, "data/preview.jpg");
+    else
+    {
+        assign_image(view.gray, sub_image(img, view.roi));
+    }
+    // 调试预览(默认关闭, 避免请求路径写盘)
+    if (config.debug_preview)
+    {
+        dlib::save_jpeg(view.gray, "data/preview.jpg");
+    }
+    return view.scale;
 }
 
 class FaceUtil
 {
 public:
-    FaceUtil()
+    FaceUtil() : detector(FaceConfig::get().detect_threads)
     {
-        // 初始化人脸检测器
-        detector = get_frontal_face_detector();
         // 初始化人脸关键点预测器
-        deserialize("model/predictor.dat") >> sp;
+        sp = FaceLandmark::load();
         // 初始化人脸识别模型
-        deserialize("model/recognition.dat") >> net;
+        net.reset(new anet_type);
+        deserialize("model/recognition.dat") >> *net;
         cout << "[FU] Model loaded" << endl;
     }
 
-    // 获取人脸特征
-    std::vector<matrix<float, 0, 1>> getFaceDescriptors(std::string image_data)
+    /*
+    基于已加载模型创建副本
+    -----------------
+    predictor   关键点预测器(只读, 各副本共享)
+    recognition 人脸识别网络(前向计算会写入内部缓冲, 每个副本持有一份拷贝);
+                为空时副本只做检测与对齐, 特征由合批调度器统一计算
+    */
+    FaceUtil(std::shared_ptr<const shape_predictor> predictor, const anet_type *recognition)
+        : detector(FaceConfig::get().detect_threads), sp(std::move(predictor)), net(recognition ? new anet_type(*recognition) : nullptr)
+    {
+    }
+
+    /*
+    获取人脸特征(直接从上传内容解码, 不落盘)
+    -----------------
+    boxes 非空时输出各人脸在原图中的位置
+    roi   只在原图的该区域内检测(为空时检测整图)
+    */
+    std::vector<matrix<float, 0, 1>> getFaceDescriptors(const std::string &image_data, std::vector<rectangle> *boxes = nullptr, const rectangle &roi = rectangle())
     {
-        std::string temp_name = getTempFileName();
         try
         {
-            // 将图像数据写入临时文件
-            std::ofstream temp_file(temp_name, std::ios::binary);
-            temp_file.write(image_data.c_str(), image_data.length());
-            temp_file.close();
-            // 从临时文件加载图像
-            array2d<rgb_pixel> img;
-            load_image(img, temp_name);
-            preprocess_face_image(img);
-            // 定义人脸图像矩阵向量
-            std::vector<matrix<rgb_pixel>> faces;
-            // 使用人脸检测器返回检测到每张人脸
-            for (auto face : detector(img))
+            std::vector<matrix<rgb_pixel>> faces = getFaceChips(image_data, boxes, roi);
+            return embed(faces);
+        }
+        catch (const std::exception &e)
+        {
+            return std::vector<matrix<float, 0, 1>>();
+        }
+    }
+
+    // 检测人脸并提取对齐后的 150x150 人脸图像块
+    std::vector<matrix<rgb_pixel>> getFaceChips(const std::string &image_data, std::vector<rectangle> *boxes = nullptr, const rectangle &roi = rectangle())
+    {
+        // 定义人脸图像矩阵向量
+        std::vector<matrix<rgb_pixel>> faces;
+        try
+        {
+            // 从内存解码图像(复用副本的原图缓冲)
             {
-                // 提取人脸的关键点
-                auto shape = sp(img, face);
-                // 定义人脸图像矩阵
-                matrix<rgb_pixel> face_chip;
-                // 提取人脸图像块
-                extract_image_chip(img, get_face_chip_details(shape, 150, 0.25), face_chip);
-                // 加入向量
-                faces.push_back(std::move(face_chip));
+                FaceTimer timer(FaceMetrics::DECODE);
+                if (!FaceImage::decode(image_data, original))
+                {
+                    return faces;
+                }
             }
-            // 识别完成后删除临时文件
-            std::remove(temp_name.c_str());
-            // 判断是否检测到人脸
-            if (faces.size() != 0)
             {
-                // 提取人脸特征
-                return net(faces);
+                FaceTimer timer(FaceMetrics::PREPROCESS);
+                preprocess_face_image(original, view, roi);
+            }
+            // 使用人脸检测器返回检测到每张人脸
+            std::vector<rectangle> detected = detectFaces(view);
+            for (auto face : detected)
+            {
+                // 换算回原图坐标
+                rectangle box = view.toOriginal(face);
+                if (boxes)
+                {
+                    boxes->push_back(box);
+                }
+                // 在原图上提取对齐后的人脸图像块并加入向量
+                faces.push_back(faceChip(original, box));
             }
-            return std::vector<matrix<float, 0, 1>>();
         }
         catch (const std::exception &e)
         {
-            // 出错时删除临时文件
-            std::remove(temp_name.c_str());
+            faces.clear();
+            if (boxes)
+            {
+                boxes->clear();
+            }
+        }
+        return faces;
+    }
+
+    // 在检测视图上检测人脸, 返回检测图坐标(配置了上采样时先放大再检测)
+    std::vector<rectangle> detectFaces(const FaceDetectionView &view)
+    {
+        std::vector<rectangle> detected;
+        if (view.gray.size() == 0)
+        {
+            return detected;
+        }
+        {
+            FaceTimer timer(FaceMetrics::DETECT);
+            unsigned int levels = static_cast<unsigned int>(FaceConfig::get().detect_upsample);
+            if (levels == 0)
+            {
+                detected = detector(view.gray);
+            }
+            else
+            {
+                pyramid_down<2> pyr;
+                pyramid_up(view.gray, upsampled, pyr);
+                for (unsigned int i = 1; i < levels; i++)
+                {
+                    pyramid_up(upsampled, upsampled_next, pyr);
+                    upsampled.swap(upsampled_next);
+                }
+                detected = detector(upsampled);
+                for (rectangle &face : detected)
+                {
+                    face = pyr.rect_down(face, levels);
+                }
+            }
+        }
+        FaceMetrics::observeFaces(detected.size());
+        return detected;
+    }
+
+    // 按原图中的人脸位置提取关键点并对齐为 150x150 人脸图像块
+    matrix<rgb_pixel> faceChip(const array2d<rgb_pixel> &img, const rectangle &face)
+    {
+        // 提取人脸的关键点
+        full_object_detection shape;
+        {
+            FaceTimer timer(FaceMetrics::LANDMARK);
+            shape = (*sp)(img, face);
+        }
+        // 提取人脸图像块
+        matrix<rgb_pixel> face_chip;
+        {
+            FaceTimer timer(FaceMetrics::CHIP);
+            extract_image_chip(img, get_face_chip_details(shape, 150, 0.25), face_chip);
+            // 与灰度预处理时期录入的特征保持一致
+            if (FaceConfig::get().chip_gray)
+            {
+                for (long r = 0; r < face_chip.nr(); r++)
+                {
+                    for (long c = 0; c < face_chip.nc(); c++)
+                    {
+                        unsigned char value;
+                        assign_pixel(value, face_chip(r, c));
+                        face_chip(r, c) = rgb_pixel(value, value, value);
+                    }
+                }
+            }
+        }
+        return face_chip;
+    }
+
+    // 人脸图像块提取特征
+    std::vector<matrix<float, 0, 1>> embed(std::vector<matrix<rgb_pixel>> &faces)
+    {
+        if (faces.empty())
+        {
             return std::vector<matrix<float, 0, 1>>();
         }
+        if (!net)
+        {
+            throw std::logic_error("replica has no recognition network");
+        }
+        FaceTimer timer(FaceMetrics::EMBED);
+        return (*net)(faces);
     }
 
     // 计算欧式距离
@@ -107,22 +259,18 @@ public:
         {
             return 1.0f;
         }
-        // 计算欧氏距离
-        matrix<float, 0, 1> diff = vec1 - vec2;
-        float distance = length(diff);
-        return distance;
-    }
-private:
-    // 获取临时文件名称
-    std::string getTempFileName()
-    {
-        std::time_t timestamp = std::time(nullptr);
-        std::ostringstream temp_filename_stream;
-        temp_filename_stream << "temp_" << std::put_time(std::localtime(&timestamp), "%Y%m%d%H%M%S") << ".jpg";
-        return temp_filename_stream.str();
+        // 计算欧氏距离(直接在原数据上计算, 不产生临时向量)
+        return std::sqrt(FaceDistance::l2sq(vec1.begin(), vec2.begin(), vec1.size()));
     }
 private:
-    frontal_face_detector detector;
-    shape_predictor sp;
-    anet_type net;
+    // 检测器扫描时会缓存特征金字塔, 不可跨线程共享
+    FaceDetector detector;
+    std::shared_ptr<const shape_predictor> sp;
+    // 只做检测的副本为空
+    std::unique_ptr<anet_type> net;
+    // 每个副本同一时刻只服务一个请求, 解码与检测缓冲跨请求复用
+    array2d<rgb_pixel> original;
+    FaceDetectionView view;
+    array2d<unsigned char> upsampled;
+    array2d<unsigned char> upsampled_next;
 };
\ No newline at end of file
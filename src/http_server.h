@@ -3,10 +3,16 @@
 // License: AGPL-3.0
 #pragma once
 
+#include <cmath>
+#include <cstdio>
+#include <unordered_set>
 #include "../cpp-httplib/httplib.h"
 #include "../nlohmann/json.hpp"
-#include "face_util.h"
+#include "face_metrics.h"
+#include "face_pool.h"
 #include "face_data.h"
+#include "face_jobs.h"
+#include "face_stream.h"
 
 using json = nlohmann::json;
 using namespace httplib;
@@ -15,7 +21,7 @@ using namespace std;
 class HttpServer
 {
 public:
-    HttpServer()
+    HttpServer() : pool(FaceConfig::get()), jobs(FaceConfig::get().job_workers, FaceConfig::get().job_queue, FaceConfig::get().job_ttl_s)
     {
         // 初始化数据库
         if (data.init())
@@ -29,57 +35,168 @@ public:
 
         // 设置HTTP路由
         server.Post("/add", [&](const Request &req, Response &res)
-                    { handleAddFace(req, res); });
+                    { dispatch(req, res, FaceJobs::LOW, &HttpServer::handleAddFace); });
         server.Post("/remove", [&](const Request &req, Response &res)
                     { handleRemoveFace(req, res); });
         server.Post("/exists", [&](const Request &req, Response &res)
                     { handleExistsFace(req, res); });
         server.Post("/match", [&](const Request &req, Response &res)
-                    { handleMatchFace(req, res); });
+                    { dispatch(req, res, FaceJobs::HIGH, &HttpServer::handleMatchFace); });
+        server.Post("/job", [&](const Request &req, Response &res)
+                    { handleJob(req, res); });
+        server.Post("/add_batch", [&](const Request &req, Response &res)
+                    { handleAddBatch(req, res); });
+        server.Post("/match_batch", [&](const Request &req, Response &res)
+                    { handleMatchBatch(req, res); });
+        server.Post("/add_descriptor", [&](const Request &req, Response &res)
+                    { handleAddDescriptor(req, res); });
+        server.Post("/match_descriptor", [&](const Request &req, Response &res)
+                    { handleMatchDescriptor(req, res); });
+        server.Post("/stream", [&](const Request &req, Response &res, const ContentReader &content_reader)
+                    { handleStream(req, res, content_reader); });
+        server.Post("/stream_close", [&](const Request &req, Response &res)
+                    { handleStreamClose(req, res); });
+        server.Post("/recall", [&](const Request &req, Response &res)
+                    { handleRecall(req, res); });
+        server.Post("/stats", [&](const Request &req, Response &res)
+                    { handleStats(req, res); });
+        server.Post("/groups", [&](const Request &req, Response &res)
+                    { handleGroups(req, res); });
+        server.Get("/metrics", [&](const Request &req, Response &res)
+                   { handleMetrics(req, res); });
+        // 路由前记录请求开始时间, 处理函数入口据此统计请求体与表单解析耗时
+        server.set_pre_routing_handler([](const Request &req, Response &res)
+                                       {
+                                           FaceMetrics::markRequestStart();
+                                           return Server::HandlerResponse::Unhandled; });
         cout << "[HS] Route mounted" << endl;
     }
 
     void startServer()
     {
+        // 工作线程数不少于推理副本数, 保证副本可被占满
+        size_t threads = std::max<size_t>(CPPHTTPLIB_THREAD_POOL_COUNT, pool.size() + 2);
+        server.new_task_queue = [threads]
+        { return new ThreadPool(threads); };
         cout << "[HS] Http server started" << endl;
         // 启动 HTTP 服务器
         server.listen("0.0.0.0", 8080);
     }
 
 private:
+    /*
+    分发请求
+    -----------------
+    默认在当前线程同步处理; url参数 async=1 时复制请求提交到任务队列, 立即返回任务编号
+    队列已满时返回 503 与建议的重试间隔 Retry-After
+    */
+    void dispatch(const Request &req, Response &res, FaceJobs::Priority priority, void (HttpServer::*handler)(const Request &, Response &))
+    {
+        FaceMetrics::observeSinceRequestStart(FaceMetrics::MULTIPART);
+        if (getSizeParam(req, "async", 0) == 0)
+        {
+            (this->*handler)(req, res);
+            return;
+        }
+        json result_json;
+        std::shared_ptr<Request> copy = std::make_shared<Request>(req);
+        std::string id = jobs.submit(priority, [this, handler, copy](int &code, std::string &body)
+                                     {
+                                         Response job_res;
+                                         (this->*handler)(*copy, job_res);
+                                         code = job_res.status;
+                                         body = job_res.body; });
+        if (id.empty())
+        {
+            res.set_header("Retry-After", std::to_string(jobs.retryAfter()));
+            httpReturnError(res, result_json, "任务队列已满,请稍后重试", 503);
+            cout << "[JQ] Queue full, reject " << req.path << endl;
+            return;
+        }
+        json result;
+        result["job"] = id;
+        result["status"] = "queued";
+        httpReturnResult(res, result_json, result);
+        res.status = 202;
+    }
+
+    /*
+    查询异步任务结果
+    -----------------
+    url参数: id 任务编号, wait 最长等待毫秒数(长轮询, 默认0, 最大30000)
+    完成后 result.response 为同步调用时的响应体, result.code 为其状态码
+    */
+    void handleJob(const Request &req, Response &res)
+    {
+        json result_json;
+        FaceJobs::Result job;
+        if (!req.has_param("id"))
+        {
+            httpReturnError(res, result_json, "未提供任务编号", 400);
+            return;
+        }
+        std::string id = req.get_param_value("id");
+        if (!jobs.result(id, std::min<size_t>(getSizeParam(req, "wait", 0), 30000), job))
+        {
+            httpReturnError(res, result_json, "任务不存在或已过期", 404);
+            return;
+        }
+        json result;
+        result["job"] = id;
+        result["status"] = job.status;
+        if (job.status == "done")
+        {
+            result["code"] = job.code;
+            result["response"] = json::parse(job.body, nullptr, false);
+        }
+        httpReturnResult(res, result_json, result);
+    }
+
     // 添加人脸数据
     void handleAddFace(const Request &req, Response &res)
     {
         json result_json;
         try
         {
+            std::string group;
+            rectangle roi;
+            if (!getGroup(req, group))
+            {
+                httpReturnError(res, result_json, "分组名不合法", 400);
+                return;
+            }
+            if (!getRoi(req, roi))
+            {
+                httpReturnError(res, result_json, "检测区域不合法", 400);
+                return;
+            }
             // 检查是否有文件上传
             if (req.has_file("file") && req.has_param("uid"))
             {
                 const auto &file = req.get_file_value("file");
                 std::string uid = req.get_param_value("uid");
-                if (data.exists(uid))
+                if (data.exists(uid, group))
                 {
                     httpReturnError(res, result_json, "UID已入库,请删除后再试", 200);
                 }
                 else
                 {
                     cout << "[AF] Get face descriptors" << endl;
-                    // 获取文件数据
-                    std::string image_data(file.content.data(), file.content.length());
-                    // 提取人脸特征
-                    std::vector<matrix<float, 0, 1>> face_descriptors = util.getFaceDescriptors(image_data);
-                    if (face_descriptors.size() == 0)
+                    // 检查图片格式与尺寸
+                    std::string image_error;
+                    std::vector<matrix<float, 0, 1>> face_descriptors;
+                    if (!FaceImage::check(file.content, image_error))
                     {
-                        httpReturnError(res, result_json, "未检测到人脸", 200);
+                        httpReturnError(res, result_json, image_error, 400);
                     }
-                    else if (data.save(uid, face_descriptors[0]))
+                    // 提取人脸特征
+                    else if ((face_descriptors = pool.getFaceDescriptors(file.content, nullptr, roi)).size() == 0)
                     {
-                        httpReturnSuccess(res, result_json, "人脸已录入");
+                        httpReturnError(res, result_json, "未检测到人脸", 200);
                     }
                     else
                     {
-                        httpReturnError(res, result_json, "人脸数据保存失败", 200);
+                        returnSave(res, result_json, uid, face_descriptors[0], group);
                     }
                 }
             }
@@ -100,11 +217,17 @@ private:
         json result_json;
         try
         {
+            std::string group;
+            if (!getGroup(req, group))
+            {
+                httpReturnError(res, result_json, "分组名不合法", 400);
+                return;
+            }
             // 检查是否提供uid
             if (req.has_param("uid"))
             {
                 std::string uid = req.get_param_value("uid");
-                if (data.remove(uid))
+                if (data.remove(uid, group))
                 {
                     httpReturnSuccess(res, result_json, "人脸已删除");
                 }
@@ -130,11 +253,17 @@ private:
         json result_json;
         try
         {
+            std::string group;
+            if (!getGroup(req, group))
+            {
+                httpReturnError(res, result_json, "分组名不合法", 400);
+                return;
+            }
             // 检查是否提供uid
             if (req.has_param("uid"))
             {
                 std::string uid = req.get_param_value("uid");
-                if (data.exists(uid))
+                if (data.exists(uid, group))
                 {
                     httpReturnSuccess(res, result_json, "UID已录入人脸");
                 }
@@ -160,74 +289,589 @@ private:
         json result_json;
         try
         {
+            std::string group;
+            rectangle roi;
+            if (!getGroup(req, group))
+            {
+                httpReturnError(res, result_json, "分组名不合法", 400);
+                return;
+            }
+            if (!getRoi(req, roi))
+            {
+                httpReturnError(res, result_json, "检测区域不合法", 400);
+                return;
+            }
+            float threshold;
+            if (!getThreshold(req, threshold))
+            {
+                httpReturnError(res, result_json, "阈值不合法", 400);
+                return;
+            }
             // 检查是否有文件上传
             if (req.has_file("file"))
             {
-                float threshold = 0.3;
-                if (req.has_param("valve"))
-                {
-                    try
-                    {
-                        std::string valve = req.get_param_value("valve");
-                        threshold = std::stof(valve);
-                    }
-                    catch (const std::invalid_argument &eia)
-                    {
-                        threshold = 0.3;
-                    }
-                }
+                // 近似检索时扫描的倒排列表数
+                size_t probes = getSizeParam(req, "probes", 0);
                 const auto &file = req.get_file_value("file");
                 cout << "[MF] Get face descriptors" << endl;
-                // 获取文件数据
-                std::string image_data(file.content.data(), file.content.length());
+                // 检查图片格式与尺寸
+                std::string image_error;
+                std::vector<matrix<float, 0, 1>> face_descriptors;
+                std::vector<rectangle> face_boxes;
+                if (!FaceImage::check(file.content, image_error))
+                {
+                    httpReturnError(res, result_json, image_error, 400);
+                }
                 // 提取人脸特征
-                const std::vector<matrix<float, 0, 1>> face_descriptors = util.getFaceDescriptors(image_data);
-                if (face_descriptors.size() == 0)
+                else if ((face_descriptors = pool.getFaceDescriptors(file.content, &face_boxes, roi)).size() == 0)
                 {
                     httpReturnError(res, result_json, "未检测到人脸", 200);
                 }
+                // 指定 top 时返回每张人脸的位置与前 k 个候选
+                else if (req.has_param("top"))
+                {
+                    size_t top = std::min<size_t>(std::max<size_t>(1, getSizeParam(req, "top", 1)), 100);
+                    returnMatchAll(res, result_json, data.gallery(group), face_descriptors, face_boxes, threshold, top, probes);
+                }
+                else
+                {
+                    returnMatch(res, result_json, data.gallery(group), face_descriptors[0], threshold, probes, "[MF]");
+                }
+            }
+            else
+            {
+                httpReturnError(res, result_json, "未上传文件", 400);
+            }
+        }
+        catch (const std::exception &e)
+        {
+            httpReturnError(res, result_json, "服务出错", 500);
+        }
+    }
+
+    // 按特征添加人脸数据
+    void handleAddDescriptor(const Request &req, Response &res)
+    {
+        json result_json;
+        try
+        {
+            std::string group;
+            if (!getGroup(req, group))
+            {
+                httpReturnError(res, result_json, "分组名不合法", 400);
+                return;
+            }
+            matrix<float, 0, 1> face_descriptor;
+            std::string descriptor_error;
+            if (!req.has_param("uid"))
+            {
+                httpReturnError(res, result_json, "未提供UID", 400);
+            }
+            else if (!parseDescriptor(req, face_descriptor, descriptor_error))
+            {
+                httpReturnError(res, result_json, descriptor_error, 400);
+            }
+            else
+            {
+                std::string uid = req.get_param_value("uid");
+                if (data.exists(uid, group))
+                {
+                    httpReturnError(res, result_json, "UID已入库,请删除后再试", 200);
+                }
                 else
                 {
-                    // 获取所有存储的人脸数据
-                    std::vector<FaceData::FaceObject> face_list = data.all_list();
-                    if (face_list.empty())
+                    returnSave(res, result_json, uid, face_descriptor, group);
+                }
+            }
+        }
+        catch (const std::exception &e)
+        {
+            httpReturnError(res, result_json, "服务出错", 500);
+        }
+    }
+
+    // 按特征匹配人脸(跳过图像处理)
+    void handleMatchDescriptor(const Request &req, Response &res)
+    {
+        json result_json;
+        try
+        {
+            std::string group;
+            if (!getGroup(req, group))
+            {
+                httpReturnError(res, result_json, "分组名不合法", 400);
+                return;
+            }
+            float threshold;
+            if (!getThreshold(req, threshold))
+            {
+                httpReturnError(res, result_json, "阈值不合法", 400);
+                return;
+            }
+            matrix<float, 0, 1> face_descriptor;
+            std::string descriptor_error;
+            if (!parseDescriptor(req, face_descriptor, descriptor_error))
+            {
+                httpReturnError(res, result_json, descriptor_error, 400);
+            }
+            else
+            {
+                returnMatch(res, result_json, data.gallery(group), face_descriptor, threshold, getSizeParam(req, "probes", 0), "[MD]");
+            }
+        }
+        catch (const std::exception &e)
+        {
+            httpReturnError(res, result_json, "服务出错", 500);
+        }
+    }
+
+    // 保存人脸特征并返回结果
+    void returnSave(Response &res, json result_json, const std::string &uid, const matrix<float, 0, 1> &face_descriptor, const std::string &group)
+    {
+        if (data.save(uid, face_descriptor, group))
+        {
+            httpReturnSuccess(res, result_json, "人脸已录入");
+        }
+        else
+        {
+            httpReturnError(res, result_json, "人脸数据保存失败", 200);
+        }
+    }
+
+    // 在分组的常驻人脸库中匹配并返回结果
+    void returnMatch(Response &res, json result_json, const FaceGallery &gallery, const matrix<float, 0, 1> &face_descriptor, float threshold, size_t probes, const std::string &tag)
+    {
+        if (gallery.empty())
+        {
+            httpReturnError(res, result_json, "服务尚未初始化", 200);
+            return;
+        }
+        // 计算欧式距离并找到最小距离对应的标识符
+        std::vector<std::vector<FaceGallery::Match>> found = gallery.search({face_descriptor}, threshold, 1, probes);
+        std::string uid = found[0].empty() ? "" : found[0][0].uid;
+        if (uid.empty())
+        {
+            httpReturnError(res, result_json, "无匹配", 200);
+            cout << tag << " No match\n"
+                 << endl;
+        }
+        else
+        {
+            httpReturnSuccess(res, result_json, uid);
+            cout << tag << " Match UID-" << uid << "\n"
+                 << endl;
+        }
+    }
+
+    // 一次扫描为全部人脸匹配前 k 个候选并返回
+    void returnMatchAll(Response &res, json result_json, const FaceGallery &gallery, const std::vector<matrix<float, 0, 1>> &face_descriptors,
+                        const std::vector<rectangle> &face_boxes, float threshold, size_t top, size_t probes)
+    {
+        std::vector<std::vector<FaceGallery::Match>> found = gallery.search(face_descriptors, threshold, top, probes);
+        json faces = json::array();
+        for (size_t i = 0; i < face_descriptors.size(); i++)
+        {
+            json face;
+            if (i < face_boxes.size())
+            {
+                face["box"] = {{"left", face_boxes[i].left()}, {"top", face_boxes[i].top()}, {"right", face_boxes[i].right()}, {"bottom", face_boxes[i].bottom()}};
+            }
+            json candidates = json::array();
+            for (const FaceGallery::Match &match : found[i])
+            {
+                candidates.push_back({{"uid", match.uid}, {"distance", match.distance}});
+            }
+            face["candidates"] = candidates;
+            faces.push_back(face);
+        }
+        cout << "[MF] Match " << face_descriptors.size() << " faces, top " << top << "\n"
+             << endl;
+        httpReturnResult(res, result_json, faces);
+    }
+
+    /*
+    解析客户端上传的人脸特征
+    -----------------
+    来源: 表单字段 descriptor, 或请求体
+    格式: JSON 数组 / {"descriptor": [...]}, 或 512 字节 float32 小端二进制
+    按 Content-Type 区分(json / octet-stream); 未声明时首字符为 [ 或 { 视为 JSON,
+    解析失败且恰为 512 字节时仍按二进制处理(二进制特征首字节可能恰好是 [ 或 {)
+    */
+    bool parseDescriptor(const Request &req, matrix<float, 0, 1> &face_descriptor, std::string &error)
+    {
+        std::string body = req.body;
+        std::string content_type = req.get_header_value("Content-Type");
+        if (req.has_file("descriptor"))
+        {
+            const auto &field = req.get_file_value("descriptor");
+            body = field.content;
+            content_type = field.content_type;
+        }
+        bool declared_json = content_type.find("json") != std::string::npos;
+        bool declared_binary = content_type.find("octet-stream") != std::string::npos;
+        size_t start = body.find_first_not_of(" \t\r\n");
+        bool is_json = declared_json ||
+                       (!declared_binary && start != std::string::npos && (body[start] == '[' || body[start] == '{'));
+        json parsed;
+        if (is_json)
+        {
+            parsed = json::parse(body, nullptr, false);
+            if (parsed.is_discarded() && !declared_json && body.size() == FACE_DIM * sizeof(float))
+            {
+                is_json = false;
+            }
+        }
+        face_descriptor.set_size(FACE_DIM);
+        if (is_json)
+        {
+            if (parsed.is_object() && parsed.contains("descriptor"))
+            {
+                parsed = parsed["descriptor"];
+            }
+            if (!parsed.is_array() || parsed.size() != FACE_DIM)
+            {
+                error = "特征维度应为128";
+                return false;
+            }
+            for (size_t i = 0; i < FACE_DIM; i++)
+            {
+                if (!parsed[i].is_number())
+                {
+                    error = "特征数据格式错误";
+                    return false;
+                }
+                face_descriptor(i) = parsed[i].get<float>();
+            }
+        }
+        else if (!FaceData::blobToDescriptor(body.data(), body.size(), &face_descriptor(0)))
+        {
+            error = "特征维度应为128";
+            return false;
+        }
+        for (size_t i = 0; i < FACE_DIM; i++)
+        {
+            if (!std::isfinite(face_descriptor(i)))
+            {
+                error = "特征数据格式错误";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // 读取匹配阈值(默认0.3), 负数、非有限值或超出范围时返回 false
+    bool getThreshold(const Request &req, float &threshold)
+    {
+        threshold = 0.3;
+        return !req.has_param("valve") || parseThreshold(req.get_param_value("valve"), threshold);
+    }
+
+    // 解析阈值文本; 无法解析时保持原值(沿用默认值), 负数、非有限值或超出范围时返回 false
+    static bool parseThreshold(const std::string &text, float &threshold)
+    {
+        float value;
+        try
+        {
+            value = std::stof(text);
+        }
+        catch (const std::invalid_argument &eia)
+        {
+            return true;
+        }
+        catch (const std::out_of_range &eor)
+        {
+            return false;
+        }
+        // 距离阈值按平方比较, 负数会被当作同样大小的正阈值
+        if (!std::isfinite(value) || value < 0)
+        {
+            return false;
+        }
+        threshold = value;
+        return true;
+    }
+
+    // 批量添加人脸数据
+    void handleAddBatch(const Request &req, Response &res)
+    {
+        json result_json;
+        FaceMetrics::observeSinceRequestStart(FaceMetrics::MULTIPART);
+        try
+        {
+            std::string group;
+            if (!getGroup(req, group))
+            {
+                httpReturnError(res, result_json, "分组名不合法", 400);
+                return;
+            }
+            std::vector<const MultipartFormData *> files = getFormFiles(req, "file");
+            std::vector<std::string> uids = getFormValues(req, "uid");
+            if (files.empty() || files.size() != uids.size())
+            {
+                httpReturnError(res, result_json, "未上传文件或文件与UID数量不一致", 400);
+                return;
+            }
+            cout << "[AB] Get face descriptors of " << files.size() << " files" << endl;
+            json items = json::array();
+            std::vector<size_t> pending;
+            std::vector<const std::string *> images;
+            std::unordered_set<std::string> seen;
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                std::string image_error;
+                items.push_back(batchItem(uids[i], false, ""));
+                if (!seen.insert(uids[i]).second || data.exists(uids[i], group))
+                {
+                    items[i]["result"] = "UID已入库,请删除后再试";
+                }
+                else if (!FaceImage::check(files[i]->content, image_error))
+                {
+                    items[i]["result"] = image_error;
+                }
+                else
+                {
+                    pending.push_back(i);
+                    images.push_back(&files[i]->content);
+                }
+            }
+            // 并行提取人脸特征
+            std::vector<std::vector<matrix<float, 0, 1>>> descriptors = pool.getFaceDescriptorsBatch(images);
+            std::vector<FaceData::FaceObject> objs;
+            std::vector<size_t> saved;
+            for (size_t p = 0; p < pending.size(); p++)
+            {
+                if (descriptors[p].empty())
+                {
+                    items[pending[p]]["result"] = "未检测到人脸";
+                    continue;
+                }
+                objs.push_back(FaceData::FaceObject{uids[pending[p]], descriptors[p][0], group});
+                saved.push_back(pending[p]);
+            }
+            // 单个事务写入, 每条独立成败(如并发录入了相同 uid 只影响该条)
+            std::vector<bool> ok = data.saveEach(objs);
+            for (size_t s = 0; s < saved.size(); s++)
+            {
+                bool row_ok = s < ok.size() && ok[s];
+                items[saved[s]]["state"] = row_ok;
+                items[saved[s]]["result"] = row_ok ? "人脸已录入" : "人脸数据保存失败";
+            }
+            httpReturnResult(res, result_json, items);
+        }
+        catch (const std::exception &e)
+        {
+            httpReturnError(res, result_json, "服务出错", 500);
+        }
+    }
+
+    // 批量匹配人脸
+    void handleMatchBatch(const Request &req, Response &res)
+    {
+        json result_json;
+        FaceMetrics::observeSinceRequestStart(FaceMetrics::MULTIPART);
+        try
+        {
+            std::string group;
+            if (!getGroup(req, group))
+            {
+                httpReturnError(res, result_json, "分组名不合法", 400);
+                return;
+            }
+            std::vector<const MultipartFormData *> files = getFormFiles(req, "file");
+            if (files.empty())
+            {
+                httpReturnError(res, result_json, "未上传文件", 400);
+                return;
+            }
+            // 阈值可逐个提供, 也可只提供一个供全部使用; 不合法的阈值只影响对应条目
+            std::vector<std::string> valves = getFormValues(req, "valve");
+            std::vector<float> thresholds(files.size(), 0.3f);
+            std::vector<char> threshold_ok(files.size(), 1);
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                const std::string *valve = valves.size() == files.size() ? &valves[i] : (valves.size() == 1 ? &valves[0] : nullptr);
+                if (valve)
+                {
+                    threshold_ok[i] = parseThreshold(*valve, thresholds[i]);
+                }
+            }
+            size_t probes = getSizeParam(req, "probes", 0);
+            cout << "[MB] Get face descriptors of " << files.size() << " files" << endl;
+            json items = json::array();
+            std::vector<size_t> pending;
+            std::vector<const std::string *> images;
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                std::string image_error;
+                items.push_back(batchItem("", false, ""));
+                if (!threshold_ok[i])
+                {
+                    items[i]["result"] = "阈值不合法";
+                }
+                else if (!FaceImage::check(files[i]->content, image_error))
+                {
+                    items[i]["result"] = image_error;
+                }
+                else
+                {
+                    pending.push_back(i);
+                    images.push_back(&files[i]->content);
+                }
+            }
+            std::vector<std::vector<matrix<float, 0, 1>>> descriptors = pool.getFaceDescriptorsBatch(images);
+            // 所有特征一次扫描人脸库, 按最大阈值检索后再逐个比较各自阈值
+            std::vector<matrix<float, 0, 1>> faces;
+            std::vector<size_t> owners;
+            float max_threshold = 0;
+            for (size_t p = 0; p < pending.size(); p++)
+            {
+                if (descriptors[p].empty())
+                {
+                    items[pending[p]]["result"] = "未检测到人脸";
+                    continue;
+                }
+                faces.push_back(descriptors[p][0]);
+                owners.push_back(pending[p]);
+                max_threshold = std::max(max_threshold, thresholds[pending[p]]);
+            }
+            std::vector<std::vector<FaceGallery::Match>> found = data.gallery(group).search(faces, max_threshold, 1, probes);
+            for (size_t f = 0; f < faces.size(); f++)
+            {
+                size_t i = owners[f];
+                if (found[f].empty() || found[f][0].distance > thresholds[i])
+                {
+                    items[i]["result"] = "无匹配";
+                    continue;
+                }
+                items[i]["state"] = true;
+                items[i]["result"] = found[f][0].uid;
+                items[i]["distance"] = found[f][0].distance;
+            }
+            httpReturnResult(res, result_json, items);
+        }
+        catch (const std::exception &e)
+        {
+            httpReturnError(res, result_json, "服务出错", 500);
+        }
+    }
+
+    /*
+    视频流帧上传
+    -----------------
+    url参数: session 会话编号(缺省时新建会话), 新建时可指定 group、valve、detect_every
+    请求体: multipart 的多个 frame/file 字段, 或连续的 MJPEG 字节流
+    帧随上传逐个处理, 不缓存整个请求体, 返回本次请求产生的轨迹事件
+    */
+    void handleStream(const Request &req, Response &res, const ContentReader &content_reader)
+    {
+        json result_json;
+        try
+        {
+            std::string id = req.has_param("session") ? req.get_param_value("session") : "";
+            std::shared_ptr<FaceStreamSession> session;
+            if (!id.empty())
+            {
+                session = streams.find(id);
+                if (!session)
+                {
+                    httpReturnError(res, result_json, "会话不存在或已过期", 404);
+                    return;
+                }
+            }
+            else
+            {
+                std::string group;
+                float threshold;
+                if (!getGroup(req, group))
+                {
+                    httpReturnError(res, result_json, "分组名不合法", 400);
+                    return;
+                }
+                if (!getThreshold(req, threshold))
+                {
+                    httpReturnError(res, result_json, "阈值不合法", 400);
+                    return;
+                }
+                FaceStreamSession::Settings settings{group, threshold, getSizeParam(req, "detect_every", FaceConfig::get().stream_detect_every)};
+                session = streams.open(settings, id);
+                cout << "[ST] Open stream session " << id << endl;
+            }
+            std::lock_guard<std::mutex> lock(session->mutex);
+            const FaceGallery &gallery = data.gallery(session->getSettings().group);
+            json events = json::array();
+            size_t received = 0;
+            size_t invalid = 0;
+            size_t oversized = 0;
+            auto process = [&](const std::string &frame)
+            {
+                received++;
+                if (!session->processFrame(frame, pool, gallery, events))
+                {
+                    invalid++;
+                }
+            };
+            if (req.is_multipart_form_data())
+            {
+                std::string frame;
+                bool is_frame = false;
+                // 当前帧超过上限, 丢弃其余数据并计数, 不把截断的图像交给解码与跟踪
+                bool too_large = false;
+                auto finish = [&]()
+                {
+                    if (too_large)
                     {
-                        httpReturnError(res, result_json, "服务尚未初始化", 200);
+                        oversized++;
                     }
-                    else
+                    else if (is_frame)
                     {
-                        // 计算欧式距离并找到最小距离对应的标识符
-                        float min_distance = std::numeric_limits<float>::max();
-                        std::string uid = "";
-
-                        for (const FaceData::FaceObject &obj : face_list)
+                        process(frame);
+                    }
+                    frame.clear();
+                    too_large = false;
+                };
+                content_reader(
+                    [&](const MultipartFormData &field)
+                    {
+                        finish();
+                        is_frame = field.name == "frame" || field.name == "file";
+                        return true;
+                    },
+                    [&](const char *chunk, size_t size)
+                    {
+                        if (is_frame && !too_large)
                         {
-                            float distance = util.euclideanDistance(obj.face, face_descriptors[0]);
-                            if (distance < min_distance && distance <= threshold)
+                            if (frame.size() + size > STREAM_MAX_FRAME_BYTES)
                             {
-                                min_distance = distance;
-                                uid = obj.uid;
+                                too_large = true;
+                                std::string().swap(frame);
+                            }
+                            else
+                            {
+                                frame.append(chunk, size);
                             }
                         }
-                        if (uid.empty())
-                        {
-                            httpReturnError(res, result_json, "无匹配", 200);
-                            cout << "[MF] No match\n"
-                                 << endl;
-                        }
-                        else
-                        {
-                            httpReturnSuccess(res, result_json, uid);
-                            cout << "[MF] Match UID-" << uid << "\n"
-                                 << endl;
-                        }
-                    }
-                }
+                        return true;
+                    });
+                finish();
             }
             else
             {
-                httpReturnError(res, result_json, "未上传文件", 400);
+                MjpegSplitter splitter(STREAM_MAX_FRAME_BYTES);
+                content_reader([&](const char *chunk, size_t size)
+                               {
+                                   splitter.feed(chunk, size, process);
+                                   return true; });
+                oversized = splitter.dropped();
             }
+            session->last_used = std::chrono::steady_clock::now();
+            json result = session->stats();
+            result["session"] = id;
+            result["received"] = received;
+            result["invalid"] = invalid;
+            result["oversized"] = oversized;
+            result["events"] = events;
+            cout << "[ST] Session " << id << " processed " << received << " frames, " << oversized << " oversized, " << events.size() << " events" << endl;
+            httpReturnResult(res, result_json, result);
         }
         catch (const std::exception &e)
         {
@@ -235,6 +879,269 @@ private:
         }
     }
 
+    // 关闭视频流会话
+    void handleStreamClose(const Request &req, Response &res)
+    {
+        json result_json;
+        if (!req.has_param("session"))
+        {
+            httpReturnError(res, result_json, "未提供会话编号", 400);
+        }
+        else if (streams.close(req.get_param_value("session")))
+        {
+            httpReturnSuccess(res, result_json, "会话已关闭");
+        }
+        else
+        {
+            httpReturnError(res, result_json, "会话不存在或已过期", 200);
+        }
+    }
+
+    // 评估近似检索(IVF 索引或量化扫描)召回率
+    void handleRecall(const Request &req, Response &res)
+    {
+        json result_json;
+        try
+        {
+            std::string group;
+            if (!getGroup(req, group))
+            {
+                httpReturnError(res, result_json, "分组名不合法", 400);
+                return;
+            }
+            const FaceGallery &gallery = data.gallery(group);
+            if (!gallery.indexTrained() && gallery.quantMode() == FaceQuant::NONE)
+            {
+                httpReturnError(res, result_json, "近似索引未启用或未训练, 且未启用量化", 200);
+                return;
+            }
+            float threshold = std::numeric_limits<float>::max();
+            if (req.has_param("valve") && !parseThreshold(req.get_param_value("valve"), threshold))
+            {
+                httpReturnError(res, result_json, "阈值不合法", 400);
+                return;
+            }
+            FaceGallery::Recall report = gallery.measureRecall(getSizeParam(req, "samples", 100), getSizeParam(req, "k", 10),
+                                                               threshold, getSizeParam(req, "probes", 0));
+            json result;
+            result["mode"] = report.mode;
+            result["samples"] = report.samples;
+            result["k"] = report.k;
+            result["probes"] = report.nprobe;
+            result["recall"] = report.recall;
+            result["exact_ms"] = report.exact_ms;
+            result["approx_ms"] = report.approx_ms;
+            cout << "[RC] Recall@" << report.k << " " << report.recall << " with " << report.mode << ", " << report.nprobe << " probes" << endl;
+            httpReturnResult(res, result_json, result);
+        }
+        catch (const std::exception &e)
+        {
+            httpReturnError(res, result_json, "服务出错", 500);
+        }
+    }
+
+    // Prometheus 指标
+    void handleMetrics(const Request &req, Response &res)
+    {
+        std::vector<std::pair<std::string, double>> gauges;
+        std::vector<std::pair<std::string, uint64_t>> counters;
+        gauges.push_back(std::make_pair("face_gallery_size", static_cast<double>(data.size())));
+        gauges.push_back(std::make_pair("face_workers_idle", static_cast<double>(pool.idleCount())));
+        const FaceBatcher *batcher = pool.getBatcher();
+        if (batcher)
+        {
+            gauges.push_back(std::make_pair("face_batch_queue_chips", static_cast<double>(batcher->stats().queue_chips)));
+        }
+        FaceCache *cache = pool.getCache();
+        if (cache)
+        {
+            FaceCache::Stats stats = cache->stats();
+            counters.push_back(std::make_pair("face_cache_hits_total", stats.hits));
+            counters.push_back(std::make_pair("face_cache_misses_total", stats.misses));
+            gauges.push_back(std::make_pair("face_cache_bytes", static_cast<double>(stats.bytes)));
+        }
+        FaceJobs::Stats job_stats = jobs.stats();
+        gauges.push_back(std::make_pair("face_jobs_queued", static_cast<double>(job_stats.queued_high + job_stats.queued_low)));
+        counters.push_back(std::make_pair("face_jobs_rejected_total", job_stats.rejected));
+        res.status = 200;
+        res.set_content(FaceMetrics::render(gauges, counters), "text/plain; version=0.0.4");
+    }
+
+    // 各分组人脸数
+    void handleGroups(const Request &req, Response &res)
+    {
+        json result_json;
+        httpReturnResult(res, result_json, groupSizes());
+    }
+
+    json groupSizes()
+    {
+        json groups = json::object();
+        for (const auto &item : data.groupSizes())
+        {
+            groups[item.first] = item.second;
+        }
+        return groups;
+    }
+
+    // 运行状态
+    void handleStats(const Request &req, Response &res)
+    {
+        json result_json;
+        json result;
+        result["gallery"] = data.size();
+        result["groups"] = groupSizes();
+        result["workers"] = pool.size();
+        result["streams"] = streams.size();
+        result["idle_workers"] = pool.idleCount();
+        const FaceLandmark::Info &landmark = pool.getLandmark();
+        json landmark_json;
+        landmark_json["profile"] = landmark.profile;
+        landmark_json["parts"] = landmark.parts;
+        landmark_json["file_bytes"] = landmark.file_bytes;
+        landmark_json["resident_bytes"] = landmark.resident_bytes;
+        landmark_json["load_ms"] = landmark.load_ms;
+        result["landmark"] = landmark_json;
+        FaceGallery::Footprint footprint = data.footprint();
+        json quant_json;
+        quant_json["mode"] = FaceQuant::modeName(data.quantMode());
+        quant_json["kernel"] = FaceQuant::kernelName(data.quantMode());
+        quant_json["float_bytes"] = footprint.float_bytes;
+        quant_json["code_bytes"] = footprint.code_bytes;
+        quant_json["spilled"] = data.spilled();
+        result["quant"] = quant_json;
+        const FaceBatcher *batcher = pool.getBatcher();
+        if (batcher)
+        {
+            FaceBatcher::Stats stats = batcher->stats();
+            json batch;
+            batch["queue_requests"] = stats.queue_requests;
+            batch["queue_chips"] = stats.queue_chips;
+            batch["requests"] = stats.requests;
+            batch["batches"] = stats.batches;
+            batch["chips"] = stats.chips;
+            batch["max_batch"] = stats.max_batch;
+            batch["avg_batch"] = stats.batches == 0 ? 0.0 : static_cast<double>(stats.chips) / stats.batches;
+            json histogram = json::object();
+            for (const auto &bucket : stats.histogram)
+            {
+                histogram["le_" + std::to_string(bucket.first)] = bucket.second;
+            }
+            batch["histogram"] = histogram;
+            result["batch"] = batch;
+        }
+        FaceCache *cache = pool.getCache();
+        if (cache)
+        {
+            FaceCache::Stats stats = cache->stats();
+            json cache_stats;
+            cache_stats["entries"] = stats.entries;
+            cache_stats["bytes"] = stats.bytes;
+            cache_stats["budget"] = stats.budget;
+            cache_stats["hits"] = stats.hits;
+            cache_stats["misses"] = stats.misses;
+            cache_stats["evictions"] = stats.evictions;
+            cache_stats["hit_rate"] = stats.hits + stats.misses == 0 ? 0.0 : static_cast<double>(stats.hits) / (stats.hits + stats.misses);
+            result["cache"] = cache_stats;
+        }
+        FaceJobs::Stats job_stats = jobs.stats();
+        json jobs_json;
+        jobs_json["queued_match"] = job_stats.queued_high;
+        jobs_json["queued_add"] = job_stats.queued_low;
+        jobs_json["running"] = job_stats.running;
+        jobs_json["depth"] = job_stats.depth;
+        jobs_json["submitted"] = job_stats.submitted;
+        jobs_json["rejected"] = job_stats.rejected;
+        jobs_json["completed"] = job_stats.completed;
+        jobs_json["avg_ms"] = job_stats.avg_seconds * 1000;
+        result["jobs"] = jobs_json;
+        httpReturnResult(res, result_json, result);
+    }
+
+    // 按上传顺序获取同名文件
+    std::vector<const MultipartFormData *> getFormFiles(const Request &req, const std::string &name)
+    {
+        std::vector<const MultipartFormData *> files;
+        auto range = req.files.equal_range(name);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            files.push_back(&it->second);
+        }
+        return files;
+    }
+
+    // 按顺序获取同名取值, 优先取表单字段, 其次取url参数
+    std::vector<std::string> getFormValues(const Request &req, const std::string &name)
+    {
+        std::vector<std::string> values;
+        for (const MultipartFormData *field : getFormFiles(req, name))
+        {
+            values.push_back(field->content);
+        }
+        if (values.empty())
+        {
+            auto range = req.params.equal_range(name);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                values.push_back(it->second);
+            }
+        }
+        return values;
+    }
+
+    // 读取分组参数(缺省为默认分组), 分组名超过 64 字节或含 \0 时返回 false
+    bool getGroup(const Request &req, std::string &group)
+    {
+        std::vector<std::string> values = getFormValues(req, "group");
+        group = values.empty() ? "" : values[0];
+        return group.size() <= 64 && group.find('\0') == std::string::npos;
+    }
+
+    // 读取检测区域参数 roi=left,top,right,bottom(原图坐标), 缺省为整图, 格式错误时返回 false
+    bool getRoi(const Request &req, rectangle &roi)
+    {
+        roi = rectangle();
+        if (!req.has_param("roi"))
+        {
+            return true;
+        }
+        long left, top, right, bottom;
+        char tail;
+        if (std::sscanf(req.get_param_value("roi").c_str(), "%ld,%ld,%ld,%ld%c", &left, &top, &right, &bottom, &tail) != 4 ||
+            left < 0 || top < 0 || right <= left || bottom <= top)
+        {
+            return false;
+        }
+        roi = rectangle(left, top, right, bottom);
+        return true;
+    }
+
+    json batchItem(const std::string &uid, bool state, const std::string &message)
+    {
+        json item;
+        item["uid"] = uid;
+        item["state"] = state;
+        item["result"] = message;
+        return item;
+    }
+
+    // 读取非负整数参数, 缺失或非法时返回默认值
+    size_t getSizeParam(const Request &req, const std::string &name, size_t def)
+    {
+        if (!req.has_param(name))
+        {
+            return def;
+        }
+        try
+        {
+            return std::stoul(req.get_param_value(name));
+        }
+        catch (const std::exception &e)
+        {
+            return def;
+        }
+    }
+
     void httpReturnError(Response &res, json result_json, std::string message, int code)
     {
         result_json["state"] = false;
@@ -251,8 +1158,22 @@ private:
         res.set_content(result_json.dump(), "application/json");
     }
 
+    void httpReturnResult(Response &res, json result_json, const json &result)
+    {
+        result_json["state"] = true;
+        result_json["result"] = result;
+        res.status = 200;
+        res.set_content(result_json.dump(), "application/json");
+    }
+
 private:
+    // 视频流单帧最大字节数
+    static const size_t STREAM_MAX_FRAME_BYTES = 16 * 1024 * 1024;
+
     Server server;
-    FaceUtil util;
+    FacePool pool;
     FaceData data;
+    FaceStreams streams;
+    // 最后声明, 析构时先停止任务线程
+    FaceJobs jobs;
 };
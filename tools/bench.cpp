@@ -0,0 +1,330 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-13
+// License: AGPL-3.0
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../src/face_data.h"
+#include "../src/face_util.h"
+
+using namespace dlib;
+using namespace std;
+
+/*
+识别流程微基准
+--------------------
+分别测量解码、预处理、HOG 检测、关键点、特征提取(批大小 1/8/32)、
+数据库全量读取与人脸库扫描(含量化扫描加重排的耗时与召回率), 结果以 JSON 输出便于版本间对比
+
+用法: face_rec_bench [--image 图片] [--sizes 10000,100000,1000000] [--iterations 20] [--db 临时库路径]
+模型文件缺失时跳过关键点与特征提取
+*/
+
+struct BenchResult
+{
+    std::string name;
+    json params;
+    std::vector<double> samples_ms;
+};
+
+// 重复执行并记录每次耗时(毫秒)
+BenchResult runBench(const std::string &name, const json &params, size_t iterations, const std::function<void()> &fn)
+{
+    BenchResult result{name, params, {}};
+    // 预热
+    fn();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        result.samples_ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return result;
+}
+
+json toJson(BenchResult result)
+{
+    std::vector<double> &s = result.samples_ms;
+    std::sort(s.begin(), s.end());
+    double sum = 0;
+    for (double v : s)
+    {
+        sum += v;
+    }
+    json item;
+    item["name"] = result.name;
+    item["params"] = result.params;
+    item["iterations"] = s.size();
+    item["mean_ms"] = s.empty() ? 0 : sum / s.size();
+    item["min_ms"] = s.empty() ? 0 : s.front();
+    item["p50_ms"] = s.empty() ? 0 : s[s.size() / 2];
+    item["p95_ms"] = s.empty() ? 0 : s[std::min(s.size() - 1, s.size() * 95 / 100)];
+    item["max_ms"] = s.empty() ? 0 : s.back();
+    return item;
+}
+
+// 生成带渐变与噪声的合成图片并编码为 JPEG
+std::string syntheticJpeg(long width, long height)
+{
+    array2d<rgb_pixel> img(height, width);
+    std::mt19937 rng(20231213);
+    std::uniform_int_distribution<int> noise(-20, 20);
+    for (long r = 0; r < height; r++)
+    {
+        for (long c = 0; c < width; c++)
+        {
+            int base = static_cast<int>(255.0 * (r + c) / (width + height));
+            unsigned char v = static_cast<unsigned char>(std::min(255, std::max(0, base + noise(rng))));
+            img[r][c] = rgb_pixel(v, static_cast<unsigned char>(255 - v), static_cast<unsigned char>(v / 2));
+        }
+    }
+    std::string temp_name = "face_rec_bench.jpg";
+    save_jpeg(img, temp_name, 90);
+    std::ifstream in(temp_name, std::ios::binary);
+    std::ostringstream data;
+    data << in.rdbuf();
+    std::remove(temp_name.c_str());
+    return data.str();
+}
+
+std::string readFile(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream data;
+    data << in.rdbuf();
+    return data.str();
+}
+
+bool fileExists(const std::string &path)
+{
+    std::ifstream in(path);
+    return in.good();
+}
+
+std::vector<size_t> parseSizes(const std::string &text)
+{
+    std::vector<size_t> sizes;
+    std::istringstream iss(text);
+    std::string item;
+    while (std::getline(iss, item, ','))
+    {
+        sizes.push_back(std::stoul(item));
+    }
+    return sizes;
+}
+
+// 随机特征(与真实特征相近的量级)
+void randomDescriptor(std::mt19937 &rng, float *out)
+{
+    std::normal_distribution<float> dist(0.0f, 0.09f);
+    for (size_t d = 0; d < FACE_DIM; d++)
+    {
+        out[d] = dist(rng);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string image_path;
+    std::string db_path = "face_rec_bench.store";
+    std::vector<size_t> sizes = {10000, 100000, 1000000};
+    size_t iterations = 20;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        if (key == "--image")
+            image_path = argv[i + 1];
+        else if (key == "--sizes")
+            sizes = parseSizes(argv[i + 1]);
+        else if (key == "--iterations")
+            iterations = std::max<size_t>(1, std::stoul(argv[i + 1]));
+        else if (key == "--db")
+            db_path = argv[i + 1];
+    }
+
+    // 库内日志转到标准错误, 标准输出只保留 JSON 结果
+    std::streambuf *stdout_buf = cout.rdbuf(cerr.rdbuf());
+
+    json report;
+    report["kernel"] = FaceDistance::kernelName();
+    report["results"] = json::array();
+    auto add = [&](const BenchResult &result)
+    {
+        report["results"].push_back(toJson(result));
+        cerr << "[BM] " << result.name << " " << result.params.dump() << " done" << std::endl;
+    };
+
+    // ---- 图像处理流程 -------------------------------
+    std::string image_data = image_path.empty() ? syntheticJpeg(1280, 960) : readFile(image_path);
+    json image_params = {{"source", image_path.empty() ? "synthetic" : image_path}, {"bytes", image_data.size()}};
+    array2d<rgb_pixel> decoded;
+    add(runBench("decode", image_params, iterations, [&]()
+                 { FaceImage::decode(image_data, decoded); }));
+
+    FaceDetectionView view;
+    add(runBench("preprocess_face_image", image_params, iterations, [&]()
+                 { preprocess_face_image(decoded, view); }));
+
+    frontal_face_detector detector = get_frontal_face_detector();
+    std::vector<rectangle> detected;
+    add(runBench("frontal_face_detector", image_params, iterations, [&]()
+                 { detected = detector(view.gray); }));
+
+    // 多线程逐层扫描金字塔, 同时校验结果与单线程一致
+    size_t detect_threads = std::max(2u, std::thread::hardware_concurrency());
+    FaceDetector parallel_detector(detect_threads);
+    std::vector<rectangle> parallel_detected;
+    BenchResult parallel_result = runBench("face_detector_parallel", image_params, iterations, [&]()
+                                           { parallel_detected = parallel_detector(view.gray); });
+    parallel_result.params["threads"] = detect_threads;
+    parallel_result.params["identical"] = parallel_detected == detected;
+    add(parallel_result);
+
+    // 关键点与图像块在原图上提取; 未检测到人脸时在图像中心取固定区域, 保证后续阶段有输入
+    rectangle face_rect = detected.empty() ? centered_rect(point(decoded.nc() / 2, decoded.nr() / 2), 240, 240) : view.toOriginal(detected[0]);
+    // 各关键点模型档位: 加载耗时、内存占用、关键点与对齐耗时
+    for (const char *profile : {"68", "5"})
+    {
+        std::string path = FaceLandmark::profilePath(profile);
+        if (!fileExists(path))
+        {
+            cerr << "[BM] " << path << " not found, skip shape_predictor profile " << profile << std::endl;
+            continue;
+        }
+        FaceLandmark::Info info;
+        std::shared_ptr<shape_predictor> sp = FaceLandmark::load(profile, path, &info);
+        json params = {{"profile", profile}, {"parts", info.parts}, {"file_bytes", info.file_bytes},
+                       {"resident_bytes", info.resident_bytes}, {"load_ms", info.load_ms}, {"faces_detected", detected.size()}};
+        full_object_detection shape;
+        add(runBench("shape_predictor", params, iterations, [&]()
+                     { shape = (*sp)(decoded, face_rect); }));
+        matrix<rgb_pixel> chip;
+        add(runBench("extract_image_chip", {{"profile", profile}}, iterations, [&]()
+                     { extract_image_chip(decoded, get_face_chip_details(shape, 150, 0.25), chip); }));
+    }
+
+    if (fileExists("model/recognition.dat"))
+    {
+        anet_type net;
+        deserialize("model/recognition.dat") >> net;
+        std::mt19937 rng(1);
+        std::uniform_int_distribution<int> pixel(0, 255);
+        for (size_t batch : {1, 8, 32})
+        {
+            std::vector<matrix<rgb_pixel>> chips(batch);
+            for (matrix<rgb_pixel> &chip : chips)
+            {
+                chip.set_size(150, 150);
+                for (long r = 0; r < 150; r++)
+                {
+                    for (long c = 0; c < 150; c++)
+                    {
+                        chip(r, c) = rgb_pixel(pixel(rng), pixel(rng), pixel(rng));
+                    }
+                }
+            }
+            add(runBench("anet_type", {{"batch", batch}}, std::max<size_t>(1, iterations / 4), [&]()
+                         { net(chips); }));
+        }
+    }
+    else
+    {
+        cerr << "[BM] model/recognition.dat not found, skip anet_type" << std::endl;
+    }
+
+    // ---- 人脸库 -------------------------------
+    std::mt19937 rng(20231213);
+    for (size_t size : sizes)
+    {
+        json params = {{"gallery", size}};
+        AlignedFloats rows(size * FACE_DIM);
+        for (size_t i = 0; i < size; i++)
+        {
+            randomDescriptor(rng, rows.data() + i * FACE_DIM);
+        }
+        std::vector<float> probes_data(32 * FACE_DIM);
+        for (size_t p = 0; p < 32; p++)
+        {
+            randomDescriptor(rng, probes_data.data() + p * FACE_DIM);
+        }
+        size_t scan_iterations = std::max<size_t>(1, iterations * 10000 / std::max<size_t>(size, 10000));
+        for (size_t batch : {1, 8, 32})
+        {
+            std::vector<const float *> probes;
+            for (size_t p = 0; p < batch; p++)
+            {
+                probes.push_back(probes_data.data() + p * FACE_DIM);
+            }
+            json scan_params = {{"gallery", size}, {"probes", batch}, {"k", 1}, {"threshold", 0.3}};
+            add(runBench("distance_scan", scan_params, scan_iterations, [&]()
+                         { FaceDistance::scan(rows.data(), size, FACE_DIM, probes, 0.3f, 1); }));
+        }
+        json topk_params = {{"gallery", size}, {"probes", 1}, {"k", 10}, {"threshold", 10.0}};
+        std::vector<const float *> single = {probes_data.data()};
+        add(runBench("distance_scan", topk_params, scan_iterations, [&]()
+                     { FaceDistance::scan(rows.data(), size, FACE_DIM, single, 10.0f, 10); }));
+
+        // 量化扫描加重排与全精度扫描对比: 特征内存、耗时与 recall@10
+        {
+            std::vector<std::string> uids(size);
+            for (size_t i = 0; i < size; i++)
+            {
+                uids[i] = "bench_" + std::to_string(i);
+            }
+            FaceGallery gallery;
+            gallery.reset(SpillFloats(rows.begin(), rows.end()), std::move(uids));
+            std::vector<matrix<float, 0, 1>> probe(1);
+            probe[0].set_size(FACE_DIM);
+            std::copy(probes_data.begin(), probes_data.begin() + FACE_DIM, &probe[0](0));
+            for (FaceQuant::Mode mode : {FaceQuant::NONE, FaceQuant::INT8, FaceQuant::FP16})
+            {
+                gallery.enableQuantization(mode, 32);
+                FaceGallery::Footprint footprint = gallery.footprint();
+                json quant_params = {{"gallery", size}, {"probes", 1}, {"k", 10}, {"threshold", 10.0}, {"mode", FaceQuant::modeName(mode)},
+                                     {"kernel", FaceQuant::kernelName(mode)}, {"code_bytes", footprint.code_bytes}, {"float_bytes", footprint.float_bytes}};
+                if (mode != FaceQuant::NONE)
+                {
+                    quant_params["recall"] = gallery.measureRecall(100, 10, 10.0f, 0).recall;
+                }
+                add(runBench("gallery_search", quant_params, scan_iterations, [&]()
+                             { gallery.search(probe, 10.0f, 10); }));
+            }
+        }
+
+        // 写入临时库后测量全量读取
+        std::remove(db_path.c_str());
+        {
+            FaceData data(db_path);
+            data.init();
+            const size_t chunk = 50000;
+            for (size_t start = 0; start < size; start += chunk)
+            {
+                std::vector<FaceData::FaceObject> objs;
+                for (size_t i = start; i < std::min(size, start + chunk); i++)
+                {
+                    FaceData::FaceObject obj;
+                    obj.uid = "bench_" + std::to_string(i);
+                    obj.face.set_size(FACE_DIM);
+                    std::copy(rows.begin() + i * FACE_DIM, rows.begin() + (i + 1) * FACE_DIM, &obj.face(0));
+                    objs.push_back(std::move(obj));
+                }
+                data.saveBatch(objs);
+            }
+            add(runBench("all_list", params, std::max<size_t>(1, scan_iterations / 4), [&]()
+                         { data.all_list(); }));
+        }
+        std::remove(db_path.c_str());
+    }
+
+    cout.rdbuf(stdout_buf);
+    cout << report.dump(2) << endl;
+    return 0;
+}
@@ -0,0 +1,510 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-19
+// License: AGPL-3.0
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "../src/face_data.h"
+#include "../src/face_image.h"
+#include "../src/face_pool.h"
+
+using namespace dlib;
+using namespace std;
+
+/*
+离线批量录入工具
+--------------------
+遍历图片目录(文件名去掉扩展名作为 uid)或 CSV 清单(path,uid[,group]),
+多线程按工作窃取调度调用与服务相同的 FacePool::getFaceDescriptors 提取特征,
+按大事务直接写入人脸库, 已提交的条目记入检查点, 中断后重新运行会跳过
+未检测到人脸、检测到多张人脸、图片无效或写入失败的条目写入报告(CSV), 写入失败的条目不记入检查点
+
+用法: face_rec_import (--dir 图片目录 | --csv 清单) [--group 分组] [--db data/face.store]
+                      [--threads CPU核数] [--txn 1000] [--checkpoint 库路径.import]
+                      [--report import_report.csv] [--skip-multiple 0]
+需在项目根目录运行(需要 model 目录); 服务运行中也可导入, 新数据在服务重启后载入
+工具只写数据库, 不写快照与索引文件; 导入行由触发器记入变更日志, 服务启动时随快照之后的日志回放
+*/
+
+struct ImportConfig
+{
+    std::string dir;
+    std::string csv;
+    std::string group;
+    std::string db_path = "data/face.store";
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t txn = 1000;
+    std::string checkpoint;
+    std::string report = "import_report.csv";
+    bool skip_multiple = false;
+};
+
+struct ImportEntry
+{
+    std::string path;
+    std::string uid;
+    std::string group;
+};
+
+bool isImage(const std::string &name)
+{
+    std::string lower = name;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    auto ends_with = [&](const std::string &suffix)
+    {
+        return lower.size() >= suffix.size() && lower.compare(lower.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    return ends_with(".jpg") || ends_with(".jpeg") || ends_with(".png");
+}
+
+// 递归遍历目录, 按路径排序保证每次运行顺序一致
+void walkDir(const std::string &dir, const std::string &group, std::vector<ImportEntry> &entries)
+{
+    DIR *handle = opendir(dir.c_str());
+    if (!handle)
+    {
+        return;
+    }
+    std::vector<std::string> names;
+    while (dirent *entry = readdir(handle))
+    {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..")
+        {
+            names.push_back(name);
+        }
+    }
+    closedir(handle);
+    std::sort(names.begin(), names.end());
+    for (const std::string &name : names)
+    {
+        std::string path = dir + "/" + name;
+        struct stat info;
+        if (::stat(path.c_str(), &info) != 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(info.st_mode))
+        {
+            walkDir(path, group, entries);
+        }
+        else if (isImage(name))
+        {
+            entries.push_back(ImportEntry{path, name.substr(0, name.rfind('.')), group});
+        }
+    }
+}
+
+// 读取 CSV 清单: path,uid[,group], 首行为 path 开头时视为表头
+bool readManifest(const std::string &csv, const std::string &group, std::vector<ImportEntry> &entries)
+{
+    std::ifstream in(csv);
+    if (!in)
+    {
+        return false;
+    }
+    std::string line;
+    bool first = true;
+    while (std::getline(in, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        std::vector<std::string> fields;
+        std::istringstream iss(line);
+        std::string field;
+        while (std::getline(iss, field, ','))
+        {
+            fields.push_back(field);
+        }
+        bool header = first && !fields.empty() && fields[0] == "path";
+        first = false;
+        if (header || fields.size() < 2 || fields[0].empty() || fields[1].empty())
+        {
+            continue;
+        }
+        entries.push_back(ImportEntry{fields[0], fields[1], fields.size() > 2 ? fields[2] : group});
+    }
+    return true;
+}
+
+std::string readFile(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream data;
+    data << in.rdbuf();
+    return data.str();
+}
+
+std::string csvField(const std::string &value)
+{
+    if (value.find_first_of(",\"\n") == std::string::npos)
+    {
+        return value;
+    }
+    std::string quoted = "\"";
+    for (char c : value)
+    {
+        quoted += c == '"' ? "\"\"" : std::string(1, c);
+    }
+    return quoted + "\"";
+}
+
+/*
+工作窃取调度
+--------------------
+条目按连续区间预先分给各线程, 线程先从自己队列头部取,
+取空后从其他线程队列尾部窃取, 处理耗时不均(大图、多人脸)时各核仍能同时结束
+*/
+class WorkQueues
+{
+public:
+    WorkQueues(size_t total, size_t workers)
+    {
+        for (size_t w = 0; w < workers; w++)
+        {
+            queues.emplace_back(new Queue());
+            for (size_t i = total * w / workers; i < total * (w + 1) / workers; i++)
+            {
+                queues.back()->items.push_back(i);
+            }
+        }
+    }
+
+    bool next(size_t worker, size_t &item)
+    {
+        {
+            Queue &own = *queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.items.empty())
+            {
+                item = own.items.front();
+                own.items.pop_front();
+                return true;
+            }
+        }
+        for (size_t step = 1; step < queues.size(); step++)
+        {
+            Queue &victim = *queues[(worker + step) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.items.empty())
+            {
+                item = victim.items.back();
+                victim.items.pop_back();
+                steals++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::atomic<size_t> steals{0};
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> items;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+};
+
+int main(int argc, char *argv[])
+{
+    ImportConfig config;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        std::string value = argv[i + 1];
+        if (key == "--dir")
+            config.dir = value;
+        else if (key == "--csv")
+            config.csv = value;
+        else if (key == "--group")
+            config.group = value;
+        else if (key == "--db")
+            config.db_path = value;
+        else if (key == "--threads")
+            config.threads = std::max<size_t>(1, std::stoul(value));
+        else if (key == "--txn")
+            config.txn = std::max<size_t>(1, std::stoul(value));
+        else if (key == "--checkpoint")
+            config.checkpoint = value;
+        else if (key == "--report")
+            config.report = value;
+        else if (key == "--skip-multiple")
+            config.skip_multiple = value != "0";
+    }
+    if (config.checkpoint.empty())
+    {
+        config.checkpoint = config.db_path + ".import";
+    }
+
+    // 库内日志转到标准错误, 标准输出只保留 JSON 结果
+    std::streambuf *stdout_buf = cout.rdbuf(cerr.rdbuf());
+
+    std::vector<ImportEntry> manifest;
+    if (!config.csv.empty())
+    {
+        if (!readManifest(config.csv, config.group, manifest))
+        {
+            cerr << "[IM] Cannot read --csv " << config.csv << endl;
+            return 1;
+        }
+    }
+    else if (!config.dir.empty())
+    {
+        walkDir(config.dir, config.group, manifest);
+    }
+    else
+    {
+        cerr << "[IM] Either --dir or --csv is required" << endl;
+        return 1;
+    }
+
+    std::ofstream report(config.report, std::ios::app);
+    std::mutex report_mutex;
+    auto reportEntry = [&](const ImportEntry &entry, size_t faces, const std::string &reason)
+    {
+        std::lock_guard<std::mutex> lock(report_mutex);
+        report << csvField(entry.path) << "," << csvField(entry.uid) << "," << csvField(entry.group) << "," << faces << "," << csvField(reason) << "\n";
+    };
+
+    // 跳过检查点中已处理的条目, 同一分组内重复的 uid 只保留第一个
+    std::unordered_set<std::string> done;
+    {
+        std::ifstream in(config.checkpoint);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            done.insert(line);
+        }
+    }
+    std::vector<ImportEntry> entries;
+    std::unordered_set<std::string> keys;
+    size_t resumed = 0;
+    size_t duplicates = 0;
+    for (const ImportEntry &entry : manifest)
+    {
+        if (done.count(entry.path))
+        {
+            resumed++;
+        }
+        else if (entry.group.size() > 64 || entry.group.find('\0') != std::string::npos)
+        {
+            reportEntry(entry, 0, "invalid_group");
+        }
+        else if (!keys.insert(entry.group + '\0' + entry.uid).second)
+        {
+            duplicates++;
+            reportEntry(entry, 0, "duplicate_uid");
+        }
+        else
+        {
+            entries.push_back(entry);
+        }
+    }
+    cerr << "[IM] " << manifest.size() << " entries, " << resumed << " already imported, " << entries.size() << " to process" << endl;
+
+    // 不启动后台维护, 快照与索引文件只由服务写出
+    FaceData data(config.db_path, false);
+    if (!data.init())
+    {
+        cerr << "[IM] Database initialization failed" << endl;
+        return 1;
+    }
+    // 与服务相同的推理流程, 每个线程一个副本, 不使用缓存
+    FaceConfig pool_config = FaceConfig::get();
+    pool_config.workers = config.threads;
+    pool_config.cache_mb = 0;
+    FacePool pool(pool_config);
+
+    std::ofstream checkpoint(config.checkpoint, std::ios::app);
+    std::mutex pending_mutex;
+    std::mutex commit_mutex;
+    std::vector<FaceData::FaceObject> pending_objs;
+    std::vector<const ImportEntry *> pending_entries;
+    std::vector<std::string> pending_paths;
+    std::atomic<size_t> processed(0);
+    std::atomic<size_t> enrolled(0);
+    std::atomic<size_t> no_face(0);
+    std::atomic<size_t> multiple(0);
+    std::atomic<size_t> existing(0);
+    std::atomic<size_t> failed(0);
+    std::atomic<size_t> save_failed(0);
+    auto start = std::chrono::steady_clock::now();
+
+    /*
+    写入一批结果并记录检查点
+    整批失败时(如服务同时录入了相同 uid)逐条重试, 仍失败的条目写入报告且不记入检查点, 重新运行时会再次处理
+    */
+    auto commit = [&](std::vector<FaceData::FaceObject> &objs, std::vector<const ImportEntry *> &committed, std::vector<std::string> &paths)
+    {
+        std::lock_guard<std::mutex> lock(commit_mutex);
+        std::unordered_set<std::string> unsaved;
+        if (data.saveBatch(objs))
+        {
+            enrolled += objs.size();
+        }
+        else
+        {
+            for (size_t i = 0; i < objs.size(); i++)
+            {
+                if (data.save(objs[i].uid, objs[i].face, objs[i].group))
+                {
+                    enrolled++;
+                }
+                else
+                {
+                    failed++;
+                    save_failed++;
+                    unsaved.insert(committed[i]->path);
+                    reportEntry(*committed[i], 1, "save_failed");
+                }
+            }
+        }
+        for (const std::string &path : paths)
+        {
+            if (!unsaved.count(path))
+            {
+                checkpoint << path << "\n";
+            }
+        }
+        checkpoint.flush();
+        {
+            std::lock_guard<std::mutex> report_lock(report_mutex);
+            report.flush();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cerr << "[IM] " << processed << "/" << entries.size() << " processed, " << enrolled << " enrolled, "
+             << static_cast<size_t>(processed / std::max(seconds, 1e-3)) << " images/s" << endl;
+    };
+
+    // 记录一个条目的处理结果, 攒满一个事务后提交
+    auto finish = [&](const ImportEntry &entry, const matrix<float, 0, 1> *face)
+    {
+        std::vector<FaceData::FaceObject> objs;
+        std::vector<const ImportEntry *> committed;
+        std::vector<std::string> paths;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            if (face)
+            {
+                pending_objs.push_back(FaceData::FaceObject{entry.uid, *face, entry.group});
+                pending_entries.push_back(&entry);
+            }
+            pending_paths.push_back(entry.path);
+            processed++;
+            if (pending_objs.size() < config.txn && pending_paths.size() < config.txn * 4)
+            {
+                return;
+            }
+            objs.swap(pending_objs);
+            committed.swap(pending_entries);
+            paths.swap(pending_paths);
+        }
+        commit(objs, committed, paths);
+    };
+
+    WorkQueues queues(entries.size(), config.threads);
+    auto worker = [&](size_t id)
+    {
+        size_t item;
+        while (queues.next(id, item))
+        {
+            const ImportEntry &entry = entries[item];
+            if (data.exists(entry.uid, entry.group))
+            {
+                existing++;
+                reportEntry(entry, 0, "exists");
+                finish(entry, nullptr);
+                continue;
+            }
+            std::string content = readFile(entry.path);
+            std::string image_error;
+            if (content.empty() || !FaceImage::check(content, image_error))
+            {
+                failed++;
+                reportEntry(entry, 0, content.empty() ? "unreadable" : "invalid_image: " + image_error);
+                finish(entry, nullptr);
+                continue;
+            }
+            std::vector<matrix<float, 0, 1>> descriptors = pool.getFaceDescriptors(content);
+            if (descriptors.empty())
+            {
+                no_face++;
+                reportEntry(entry, 0, "no_face");
+                finish(entry, nullptr);
+                continue;
+            }
+            if (descriptors.size() > 1)
+            {
+                multiple++;
+                reportEntry(entry, descriptors.size(), config.skip_multiple ? "multiple_faces_skipped" : "multiple_faces");
+                if (config.skip_multiple)
+                {
+                    finish(entry, nullptr);
+                    continue;
+                }
+            }
+            // 与 /add 一致, 多张人脸时录入第一张
+            finish(entry, &descriptors[0]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < config.threads; i++)
+    {
+        threads.emplace_back(worker, i);
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    {
+        std::vector<FaceData::FaceObject> objs;
+        std::vector<const ImportEntry *> committed;
+        std::vector<std::string> paths;
+        objs.swap(pending_objs);
+        committed.swap(pending_entries);
+        paths.swap(pending_paths);
+        if (!paths.empty())
+        {
+            commit(objs, committed, paths);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    json result;
+    result["entries"] = manifest.size();
+    result["resumed"] = resumed;
+    result["duplicates"] = duplicates;
+    result["processed"] = processed.load();
+    result["enrolled"] = enrolled.load();
+    result["no_face"] = no_face.load();
+    result["multiple_faces"] = multiple.load();
+    result["exists"] = existing.load();
+    result["failed"] = failed.load();
+    result["save_failed"] = save_failed.load();
+    result["steals"] = queues.steals.load();
+    result["threads"] = config.threads;
+    result["seconds"] = seconds;
+    result["images_per_s"] = seconds > 0 ? processed / seconds : 0;
+    result["report"] = config.report;
+    cout.rdbuf(stdout_buf);
+    cout << result.dump(2) << endl;
+    return failed > 0 ? 2 : 0;
+}
@@ -0,0 +1,256 @@
+// Copyright (C) 2023 Skye Zhang (skai-zhang@hotmail.com)
+// Created: Skye Zhang 2023-12-14
+// License: AGPL-3.0
+#include <dirent.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../cpp-httplib/httplib.h"
+#include "../nlohmann/json.hpp"
+
+using json = nlohmann::json;
+using namespace std;
+
+/*
+HTTP 接口压测与回放工具
+--------------------
+读取目录中的图片(JPEG/PNG), 以指定并发与速率向 face_rec 回放 /add 与 /match 请求
+统计每个接口的吞吐、p50/p95/p99/p999 延迟与错误率, 结果以 JSON 输出
+
+用法: face_rec_load --dir 图片目录 [--host 127.0.0.1] [--port 8080] [--concurrency 8]
+                    [--rate 每秒请求数, 0 为不限] [--duration 秒] [--requests 总请求数]
+                    [--add-ratio /add 占比 0~1] [--valve 0.3] [--uid-prefix load_] [--cleanup 1]
+指定速率时延迟从计划发送时刻开始计算, 避免服务变慢时少算排队时间
+*/
+
+struct LoadConfig
+{
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    std::string dir;
+    size_t concurrency = 8;
+    double rate = 0;
+    double duration = 30;
+    size_t requests = 0;
+    double add_ratio = 0;
+    std::string valve = "0.3";
+    std::string uid_prefix = "load_";
+    bool cleanup = true;
+};
+
+struct EndpointStats
+{
+    std::vector<double> latency_ms;
+    size_t errors = 0;
+    size_t rejected = 0;
+};
+
+std::vector<std::string> loadImages(const std::string &dir)
+{
+    std::vector<std::string> images;
+    DIR *handle = opendir(dir.c_str());
+    if (!handle)
+    {
+        return images;
+    }
+    std::vector<std::string> names;
+    while (dirent *entry = readdir(handle))
+    {
+        std::string name = entry->d_name;
+        std::string lower = name;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        auto ends_with = [&](const std::string &suffix)
+        {
+            return lower.size() >= suffix.size() && lower.compare(lower.size() - suffix.size(), suffix.size(), suffix) == 0;
+        };
+        if (ends_with(".jpg") || ends_with(".jpeg") || ends_with(".png"))
+        {
+            names.push_back(name);
+        }
+    }
+    closedir(handle);
+    std::sort(names.begin(), names.end());
+    for (const std::string &name : names)
+    {
+        std::ifstream in(dir + "/" + name, std::ios::binary);
+        std::ostringstream data;
+        data << in.rdbuf();
+        images.push_back(data.str());
+    }
+    return images;
+}
+
+double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+int main(int argc, char *argv[])
+{
+    LoadConfig config;
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        std::string value = argv[i + 1];
+        if (key == "--host")
+            config.host = value;
+        else if (key == "--port")
+            config.port = std::stoi(value);
+        else if (key == "--dir")
+            config.dir = value;
+        else if (key == "--concurrency")
+            config.concurrency = std::max<size_t>(1, std::stoul(value));
+        else if (key == "--rate")
+            config.rate = std::stod(value);
+        else if (key == "--duration")
+            config.duration = std::stod(value);
+        else if (key == "--requests")
+            config.requests = std::stoul(value);
+        else if (key == "--add-ratio")
+            config.add_ratio = std::min(1.0, std::max(0.0, std::stod(value)));
+        else if (key == "--valve")
+            config.valve = value;
+        else if (key == "--uid-prefix")
+            config.uid_prefix = value;
+        else if (key == "--cleanup")
+            config.cleanup = value != "0";
+    }
+    std::vector<std::string> images = loadImages(config.dir);
+    if (images.empty())
+    {
+        cerr << "[LD] No JPEG/PNG images found in --dir" << endl;
+        return 1;
+    }
+    cerr << "[LD] Loaded " << images.size() << " images, concurrency " << config.concurrency << endl;
+
+    std::atomic<size_t> ticket(0);
+    std::mutex merge_mutex;
+    std::map<std::string, EndpointStats> merged;
+    std::vector<std::string> added_uids;
+    // 每 1/add_ratio 个请求中安排一次 /add
+    size_t add_every = config.add_ratio > 0 ? static_cast<size_t>(1.0 / config.add_ratio + 0.5) : 0;
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::microseconds(static_cast<long long>(config.duration * 1e6));
+
+    auto worker = [&]()
+    {
+        httplib::Client client(config.host, config.port);
+        client.set_keep_alive(true);
+        client.set_read_timeout(60, 0);
+        std::map<std::string, EndpointStats> local;
+        std::vector<std::string> local_uids;
+        while (true)
+        {
+            size_t n = ticket++;
+            if (config.requests > 0 ? n >= config.requests : std::chrono::steady_clock::now() >= deadline)
+            {
+                break;
+            }
+            // 按速率计算计划发送时刻
+            auto planned = std::chrono::steady_clock::now();
+            if (config.rate > 0)
+            {
+                planned = start + std::chrono::microseconds(static_cast<long long>(n * 1e6 / config.rate));
+                if (config.requests == 0 && planned >= deadline)
+                {
+                    break;
+                }
+                std::this_thread::sleep_until(planned);
+            }
+            bool is_add = add_every > 0 && n % add_every == 0;
+            std::string endpoint = is_add ? "/add" : "/match";
+            std::string uid = config.uid_prefix + std::to_string(n);
+            std::string path = is_add ? "/add?uid=" + uid : "/match?valve=" + config.valve;
+            httplib::MultipartFormDataItems items = {{"file", images[n % images.size()], "image.jpg", "application/octet-stream"}};
+            auto result = client.Post(path.c_str(), items);
+            double latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - planned).count();
+            EndpointStats &stats = local[endpoint];
+            stats.latency_ms.push_back(latency);
+            if (!result || result->status >= 400)
+            {
+                stats.errors++;
+                continue;
+            }
+            json body = json::parse(result->body, nullptr, false);
+            if (!body.is_object() || !body.value("state", false))
+            {
+                stats.rejected++;
+            }
+            else if (is_add)
+            {
+                local_uids.push_back(uid);
+            }
+        }
+        std::lock_guard<std::mutex> lock(merge_mutex);
+        for (auto &item : local)
+        {
+            EndpointStats &target = merged[item.first];
+            target.latency_ms.insert(target.latency_ms.end(), item.second.latency_ms.begin(), item.second.latency_ms.end());
+            target.errors += item.second.errors;
+            target.rejected += item.second.rejected;
+        }
+        added_uids.insert(added_uids.end(), local_uids.begin(), local_uids.end());
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < config.concurrency; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    json report;
+    report["host"] = config.host + ":" + std::to_string(config.port);
+    report["concurrency"] = config.concurrency;
+    report["rate"] = config.rate;
+    report["elapsed_s"] = elapsed;
+    report["endpoints"] = json::object();
+    for (auto &item : merged)
+    {
+        std::vector<double> &latency = item.second.latency_ms;
+        std::sort(latency.begin(), latency.end());
+        json endpoint;
+        endpoint["requests"] = latency.size();
+        endpoint["throughput_rps"] = elapsed > 0 ? latency.size() / elapsed : 0;
+        endpoint["errors"] = item.second.errors;
+        endpoint["error_rate"] = latency.empty() ? 0 : static_cast<double>(item.second.errors) / latency.size();
+        endpoint["rejected"] = item.second.rejected;
+        endpoint["p50_ms"] = percentile(latency, 0.50);
+        endpoint["p95_ms"] = percentile(latency, 0.95);
+        endpoint["p99_ms"] = percentile(latency, 0.99);
+        endpoint["p999_ms"] = percentile(latency, 0.999);
+        endpoint["max_ms"] = latency.empty() ? 0 : latency.back();
+        report["endpoints"][item.first] = endpoint;
+    }
+
+    // 删除压测期间录入的数据
+    if (config.cleanup && !added_uids.empty())
+    {
+        httplib::Client client(config.host, config.port);
+        for (const std::string &uid : added_uids)
+        {
+            client.Post(("/remove?uid=" + uid).c_str(), "", "text/plain");
+        }
+        cerr << "[LD] Removed " << added_uids.size() << " added uids" << endl;
+    }
+
+    cout << report.dump(2) << endl;
+    return 0;
+}